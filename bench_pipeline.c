@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// bench_pipeline - pipeline throughput through the shell's own pipe wiring
+// Build: gcc -O2 -o bench_pipeline bench_pipeline.c myshell.c
+// Usage: ./bench_pipeline [-b total_bytes] [-s stage_counts] [-p pipe_sizes] [-m message_sizes]
+//                         [-t timeout_sec] [-o output_prefix]
+// Lists are comma separated, e.g. -s 2,3,6 -p 65536,1048576 -m 4096,65536
+// Writes <output_prefix>.csv and <output_prefix>.json (default prefix: bench_pipeline)
+//
+// Every run is a real command line handed to process_arglist, so the stages are wired by
+// establish_pipe exactly as in the shell. The producer, relay and consumer stages are this
+// same binary re-executed with --produce, --relay and --consume. A pipe end leaked into a
+// stage keeps the consumer from seeing EOF; the watchdog reports that instead of hanging.
+
+// The shell's entry point
+int process_arglist(int count, char **arglist);
+
+#define DEFAULT_TOTAL_BYTES (256L << 20)
+#define DEFAULT_TIMEOUT_SEC 60
+#define MAX_LIST 16
+
+struct result {
+    int stages;
+    long pipe_size;
+    long message_size;
+    long bytes;
+    double seconds;
+    double gb_per_sec;
+    double ctx_switches_per_mb;
+};
+
+// Helper function to resize the pipe on a stage's stdin or stdout, ignoring fds that are not pipes
+static void set_pipe_size(int fd, long pipe_size) {
+    if (pipe_size > 0) {
+        fcntl(fd, F_SETPIPE_SZ, (int)pipe_size);
+    }
+}
+
+// Helper function to write a whole buffer, retrying short writes
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int produce(long total, long message_size, long pipe_size) {
+    char *buf = malloc(message_size);
+    if (buf == NULL) {
+        return 1;
+    }
+    memset(buf, 'x', message_size);
+    set_pipe_size(STDOUT_FILENO, pipe_size);
+    while (total > 0) {
+        long len = total < message_size ? total : message_size;
+        if (write_all(STDOUT_FILENO, buf, len) == -1) {
+            perror("bench_pipeline: producer write failed");
+            return 1;
+        }
+        total -= len;
+    }
+    return 0;
+}
+
+// Middle stage: copy stdin to stdout in message-sized chunks
+static int relay(long message_size, long pipe_size) {
+    char *buf = malloc(message_size);
+    if (buf == NULL) {
+        return 1;
+    }
+    set_pipe_size(STDOUT_FILENO, pipe_size);
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf, message_size)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("bench_pipeline: relay read failed");
+            return 1;
+        }
+        if (write_all(STDOUT_FILENO, buf, n) == -1) {
+            perror("bench_pipeline: relay write failed");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Last stage: count bytes until EOF and leave the count in the result file
+static int consume(long message_size, const char *result_path) {
+    char *buf = malloc(message_size);
+    long received = 0;
+    if (buf == NULL) {
+        return 1;
+    }
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf, message_size)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("bench_pipeline: consumer read failed");
+            return 1;
+        }
+        received += n;
+    }
+    FILE *f = fopen(result_path, "w");
+    if (f == NULL) {
+        perror("bench_pipeline: unable to write the consumer result");
+        return 1;
+    }
+    fprintf(f, "%ld\n", received);
+    return fclose(f) == 0 ? 0 : 1;
+}
+
+static void watchdog(int sig) {
+    (void)sig;
+    static const char msg[] = "bench_pipeline: pipeline did not finish before the timeout, "
+                              "a stage probably holds a leaked pipe end and EOF never arrived\n";
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    _exit(3);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long child_ctx_switches(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+// Helper function to parse a comma separated list of sizes
+static int parse_list(const char *arg, long *out) {
+    int count = 0;
+    char *copy = strdup(arg);
+    for (char *tok = strtok(copy, ","); tok != NULL && count < MAX_LIST; tok = strtok(NULL, ",")) {
+        out[count++] = atol(tok);
+    }
+    free(copy);
+    return count;
+}
+
+// Build "self --produce ... | self --relay ... | ... | self --consume ..." and run it through the shell
+static int run_case(const char *self, int stages, long pipe_size, long message_size, long total,
+                    const char *result_path, struct result *res) {
+    char total_arg[32], message_arg[32], pipe_arg[32];
+    snprintf(total_arg, sizeof(total_arg), "%ld", total);
+    snprintf(message_arg, sizeof(message_arg), "%ld", message_size);
+    snprintf(pipe_arg, sizeof(pipe_arg), "%ld", pipe_size);
+
+    char **arglist = malloc(sizeof(char *) * (stages * 6 + 1));
+    int count = 0;
+    for (int i = 0; i < stages; i++) {
+        if (i > 0) {
+            arglist[count++] = "|";
+        }
+        arglist[count++] = (char *)self;
+        if (i == 0) {
+            arglist[count++] = "--produce";
+            arglist[count++] = total_arg;
+            arglist[count++] = message_arg;
+            arglist[count++] = pipe_arg;
+        } else if (i < stages - 1) {
+            arglist[count++] = "--relay";
+            arglist[count++] = message_arg;
+            arglist[count++] = pipe_arg;
+        } else {
+            arglist[count++] = "--consume";
+            arglist[count++] = message_arg;
+            arglist[count++] = (char *)result_path;
+        }
+    }
+    arglist[count] = NULL;
+
+    unlink(result_path);
+    long ctx_before = child_ctx_switches();
+    double start = now_sec();
+    int ok = process_arglist(count, arglist);
+    double elapsed = now_sec() - start;
+    long ctx = child_ctx_switches() - ctx_before;
+    free(arglist);
+    if (!ok) {
+        return -1;
+    }
+
+    long received = -1;
+    FILE *f = fopen(result_path, "r");
+    if (f == NULL || fscanf(f, "%ld", &received) != 1) {
+        fprintf(stderr, "bench_pipeline: the consumer left no result\n");
+        return -1;
+    }
+    fclose(f);
+    if (received != total) {
+        fprintf(stderr, "bench_pipeline: consumer received %ld of %ld bytes\n", received, total);
+        return -1;
+    }
+
+    res->stages = stages;
+    res->pipe_size = pipe_size;
+    res->message_size = message_size;
+    res->bytes = total;
+    res->seconds = elapsed;
+    res->gb_per_sec = total / elapsed / 1e9;
+    res->ctx_switches_per_mb = ctx / (total / 1048576.0);
+    return 0;
+}
+
+static int write_csv(const char *path, struct result *results, int count) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("bench_pipeline: unable to open the CSV output");
+        return -1;
+    }
+    fprintf(f, "stages,pipe_size,message_size,bytes,seconds,gb_per_sec,ctx_switches_per_mb\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(f, "%d,%ld,%ld,%ld,%.4f,%.3f,%.2f\n", results[i].stages, results[i].pipe_size,
+                results[i].message_size, results[i].bytes, results[i].seconds,
+                results[i].gb_per_sec, results[i].ctx_switches_per_mb);
+    }
+    return fclose(f);
+}
+
+static int write_json(const char *path, struct result *results, int count) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("bench_pipeline: unable to open the JSON output");
+        return -1;
+    }
+    fprintf(f, "[\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(f, "  {\"stages\": %d, \"pipe_size\": %ld, \"message_size\": %ld, \"bytes\": %ld, "
+                "\"seconds\": %.4f, \"gb_per_sec\": %.3f, \"ctx_switches_per_mb\": %.2f}%s\n",
+                results[i].stages, results[i].pipe_size, results[i].message_size, results[i].bytes,
+                results[i].seconds, results[i].gb_per_sec, results[i].ctx_switches_per_mb,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(f, "]\n");
+    return fclose(f);
+}
+
+int main(int argc, char **argv) {
+    // Stage roles when re-executed by the pipeline under test
+    if (argc == 5 && strcmp(argv[1], "--produce") == 0) {
+        return produce(atol(argv[2]), atol(argv[3]), atol(argv[4]));
+    }
+    if (argc == 4 && strcmp(argv[1], "--relay") == 0) {
+        return relay(atol(argv[2]), atol(argv[3]));
+    }
+    if (argc == 4 && strcmp(argv[1], "--consume") == 0) {
+        return consume(atol(argv[2]), argv[3]);
+    }
+
+    long total = DEFAULT_TOTAL_BYTES;
+    long stage_counts[MAX_LIST] = { 2, 3, 4, 6 };
+    long pipe_sizes[MAX_LIST] = { 65536, 1048576 };
+    long message_sizes[MAX_LIST] = { 4096, 65536, 1048576 };
+    int num_stage_counts = 4, num_pipe_sizes = 2, num_message_sizes = 3;
+    int timeout = DEFAULT_TIMEOUT_SEC;
+    const char *prefix = "bench_pipeline";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:p:m:t:o:")) != -1) {
+        switch (opt) {
+        case 'b': total = atol(optarg); break;
+        case 's': num_stage_counts = parse_list(optarg, stage_counts); break;
+        case 'p': num_pipe_sizes = parse_list(optarg, pipe_sizes); break;
+        case 'm': num_message_sizes = parse_list(optarg, message_sizes); break;
+        case 't': timeout = atoi(optarg); break;
+        case 'o': prefix = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-b total_bytes] [-s stage_counts] [-p pipe_sizes] "
+                    "[-m message_sizes] [-t timeout_sec] [-o output_prefix]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (int s = 0; s < num_stage_counts; s++) {
+        if (stage_counts[s] < 2) {
+            fprintf(stderr, "bench_pipeline: a pipeline needs at least 2 stages\n");
+            return 2;
+        }
+    }
+
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len == -1) {
+        perror("bench_pipeline: unable to locate its own binary");
+        return 1;
+    }
+    self[len] = '\0';
+
+    char result_path[64];
+    snprintf(result_path, sizeof(result_path), "/tmp/bench_pipeline.%d", (int)getpid());
+
+    // process_arglist waits for the stages, which needs SIGCHLD left at SIG_DFL
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGALRM, watchdog);
+
+    struct result *results = calloc(num_stage_counts * num_pipe_sizes * num_message_sizes, sizeof(struct result));
+    int count = 0;
+    for (int s = 0; s < num_stage_counts; s++) {
+        for (int p = 0; p < num_pipe_sizes; p++) {
+            for (int m = 0; m < num_message_sizes; m++) {
+                struct result *res = &results[count];
+                alarm(timeout);
+                if (run_case(self, stage_counts[s], pipe_sizes[p], message_sizes[m], total, result_path, res) != 0) {
+                    unlink(result_path);
+                    return 1;
+                }
+                alarm(0);
+                printf("stages=%d pipe=%8ld msg=%8ld  %7.3f GB/s  %8.2f ctxsw/MB\n",
+                       res->stages, res->pipe_size, res->message_size, res->gb_per_sec, res->ctx_switches_per_mb);
+                fflush(stdout);
+                count++;
+            }
+        }
+    }
+    unlink(result_path);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.csv", prefix);
+    if (write_csv(path, results, count) != 0) {
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s.json", prefix);
+    if (write_json(path, results, count) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+// bench_replay - end-to-end replay of in.txt-style scripts through the shell binary
+// Build: gcc -O2 -o bench_replay bench_replay.c
+//        gcc -O2 -o myshell shell.c myshell.c
+// Usage: ./bench_replay [-s shell] [-x sleep_scale] [-r repeats] [-b baseline] [-w new_baseline]
+//                       [-t threshold_pct] [-v] script...
+//        ./bench_replay -g lines -o generated_script
+//
+// Each script is fed to the shell on stdin with its sleeps rescaled (-x 0, the default, strips
+// them). The shell runs under ptrace so every fork and exec it or its children perform is
+// counted, and the shell's own CPU time is read when it exits. Wall time and shell CPU are the
+// median over the repeats. With -b the run is compared to a stored baseline and the exit status
+// is 1 when wall time or shell CPU grows by more than the threshold, or forks/execs grow at all.
+
+#define DEFAULT_REPEATS 5
+#define DEFAULT_THRESHOLD_PCT 10.0
+#define MAX_REPEATS 101
+#define MAX_BASELINE 256
+
+struct measurement {
+    double wall_sec;
+    double shell_cpu_sec;
+    long forks;
+    long execs;
+};
+
+struct baseline_entry {
+    char name[256];
+    struct measurement m;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Helper function to read a tracee's own CPU time, preferring the nanosecond schedstat counter
+static double read_cpu_sec(pid_t pid) {
+    char path[64];
+    unsigned long long runtime_ns;
+    snprintf(path, sizeof(path), "/proc/%d/schedstat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        int ok = fscanf(f, "%llu", &runtime_ns) == 1;
+        fclose(f);
+        if (ok) {
+            return runtime_ns / 1e9;
+        }
+    }
+
+    // Fall back to utime + stime (fields 14 and 15) in clock ticks
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (f == NULL || fgets(buf, sizeof(buf), f) == NULL) {
+        if (f != NULL) {
+            fclose(f);
+        }
+        return 0;
+    }
+    fclose(f);
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (p != NULL) {
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Helper function to tell whether a token is a plain non-negative number, as sleep arguments are in scripts
+static int is_number(const char *tok) {
+    char *end;
+    strtod(tok, &end);
+    return *tok != '\0' && *end == '\0';
+}
+
+// Rewrite a script with every "sleep N" scaled; with scale 0 standalone sleep lines are dropped
+static FILE *prepare_script(const char *path, double scale) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror("bench_replay: unable to open the script");
+        return NULL;
+    }
+    FILE *out = tmpfile();
+    if (out == NULL) {
+        perror("bench_replay: unable to create the rewritten script");
+        fclose(in);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) != -1) {
+        char *tokens[512];
+        int count = 0;
+        for (char *tok = strtok(line, " \t\n"); tok != NULL && count < 512; tok = strtok(NULL, " \t\n")) {
+            tokens[count++] = tok;
+        }
+        if (scale == 0 && count == 2 && strcmp(tokens[0], "sleep") == 0 && is_number(tokens[1])) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            int command_start = (i == 0 || strcmp(tokens[i - 1], "|") == 0);
+            if (command_start && strcmp(tokens[i], "sleep") == 0 && i + 1 < count && is_number(tokens[i + 1])) {
+                fprintf(out, "%ssleep %g", i > 0 ? " " : "", strtod(tokens[i + 1], NULL) * scale);
+                i++;
+                continue;
+            }
+            fprintf(out, "%s%s", i > 0 ? " " : "", tokens[i]);
+        }
+        fputc('\n', out);
+    }
+    free(line);
+    fclose(in);
+    fflush(out);
+    rewind(out);
+    return out;
+}
+
+// The processes being traced, so the ones still alive when the shell exits can be let go
+struct tracees {
+    pid_t *pids;
+    int count;
+    int capacity;
+};
+
+static void add_tracee(struct tracees *t, pid_t pid) {
+    for (int i = 0; i < t->count; i++) {
+        if (t->pids[i] == pid) {
+            return;
+        }
+    }
+    if (t->count == t->capacity) {
+        int capacity = t->capacity ? 2 * t->capacity : 64;
+        pid_t *pids = realloc(t->pids, sizeof(pid_t) * capacity);
+        if (pids == NULL) {
+            return; // Still detached when it next stops, just not stopped for it
+        }
+        t->pids = pids;
+        t->capacity = capacity;
+    }
+    t->pids[t->count++] = pid;
+}
+
+static void remove_tracee(struct tracees *t, pid_t pid) {
+    for (int i = 0; i < t->count; i++) {
+        if (t->pids[i] == pid) {
+            t->pids[i] = t->pids[--t->count];
+            return;
+        }
+    }
+}
+
+// Detach every tracee still alive, background jobs the script left running, so none of their stops is
+// collected by the next run's waitpid. Each is stopped to get it into a ptrace-stop, detached there, and
+// continued: the SIGCONT also discards the SIGSTOP when it detached at another stop before that arrived.
+static void detach_tracees(struct tracees *t) {
+    for (int i = 0; i < t->count; i++) {
+        kill(t->pids[i], SIGSTOP);
+    }
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, __WALL)) != -1 || errno == EINTR) {
+        if (pid == -1) {
+            continue;
+        }
+        // Children they fork meanwhile are traced as well, and come to their first stop here too
+        if (WIFSTOPPED(status)) {
+            ptrace(PTRACE_DETACH, pid, NULL, NULL);
+            kill(pid, SIGCONT);
+        }
+    }
+    free(t->pids);
+}
+
+// Run the shell once on the script under ptrace, counting forks and execs of the whole process tree
+static int run_traced(const char *shell, FILE *script, int verbose, struct measurement *m) {
+    memset(m, 0, sizeof(*m));
+    rewind(script);
+
+    double start = now_sec();
+    pid_t shell_pid = fork();
+    if (shell_pid == -1) {
+        perror("bench_replay: fork failed");
+        return -1;
+    }
+    if (shell_pid == 0) {
+        if (dup2(fileno(script), STDIN_FILENO) == -1) {
+            _exit(127);
+        }
+        if (!verbose) {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+        }
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(shell_pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        perror("bench_replay: the shell did not stop for tracing");
+        return -1;
+    }
+    long options = PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE |
+                   PTRACE_O_TRACEEXEC | PTRACE_O_TRACEEXIT;
+    if (ptrace(PTRACE_SETOPTIONS, shell_pid, NULL, (void *)options) == -1) {
+        perror("bench_replay: PTRACE_SETOPTIONS failed");
+        return -1;
+    }
+    ptrace(PTRACE_CONT, shell_pid, NULL, NULL);
+
+    // Drain tracee stops until the shell itself exits, then let go of the background jobs it left behind
+    struct tracees tracees = { NULL, 0, 0 };
+    int shell_execed = 0;
+    for (;;) {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pid == shell_pid && (WIFEXITED(status) || WIFSIGNALED(status))) {
+            m->wall_sec = now_sec() - start;
+            break;
+        }
+        if (!WIFSTOPPED(status)) {
+            remove_tracee(&tracees, pid);
+            continue;
+        }
+        add_tracee(&tracees, pid);
+
+        int sig = WSTOPSIG(status);
+        int event = status >> 16;
+        int inject = 0;
+        if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK || event == PTRACE_EVENT_CLONE) {
+            unsigned long child;
+            if (ptrace(PTRACE_GETEVENTMSG, pid, NULL, &child) == 0) {
+                add_tracee(&tracees, (pid_t)child);
+            }
+            m->forks++;
+        } else if (event == PTRACE_EVENT_EXEC) {
+            // The shell's own exec is setup, not workload
+            if (pid == shell_pid && !shell_execed) {
+                shell_execed = 1;
+            } else {
+                m->execs++;
+            }
+        } else if (event == PTRACE_EVENT_EXIT) {
+            if (pid == shell_pid) {
+                m->shell_cpu_sec = read_cpu_sec(pid);
+            }
+        } else if (event == 0 && sig != SIGTRAP && sig != SIGSTOP) {
+            // A genuine signal for the tracee, pass it on
+            inject = sig;
+        }
+        ptrace(PTRACE_CONT, pid, NULL, (void *)(long)inject);
+    }
+    remove_tracee(&tracees, shell_pid);
+    detach_tracees(&tracees);
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int load_baseline(const char *path, struct baseline_entry *entries) {
+    FILE *f = fopen(path, "r");
+    int count = 0;
+    if (f == NULL) {
+        perror("bench_replay: unable to open the baseline");
+        return -1;
+    }
+    while (count < MAX_BASELINE &&
+           fscanf(f, "%255s %lf %lf %ld %ld", entries[count].name, &entries[count].m.wall_sec,
+                  &entries[count].m.shell_cpu_sec, &entries[count].m.forks, &entries[count].m.execs) == 5) {
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+// Compare one script's numbers with its baseline entry, returning 1 on a regression
+static int check_regression(const char *name, struct measurement *m, struct baseline_entry *entries,
+                            int count, double threshold_pct) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) != 0) {
+            continue;
+        }
+        struct measurement *b = &entries[i].m;
+        double limit = 1 + threshold_pct / 100;
+        int regressed = 0;
+        if (m->wall_sec > b->wall_sec * limit) {
+            printf("  REGRESSION wall time %.3f s vs baseline %.3f s\n", m->wall_sec, b->wall_sec);
+            regressed = 1;
+        }
+        if (m->shell_cpu_sec > b->shell_cpu_sec * limit) {
+            printf("  REGRESSION shell cpu %.4f s vs baseline %.4f s\n", m->shell_cpu_sec, b->shell_cpu_sec);
+            regressed = 1;
+        }
+        if (m->forks > b->forks || m->execs > b->execs) {
+            printf("  REGRESSION forks/execs %ld/%ld vs baseline %ld/%ld\n", m->forks, m->execs, b->forks, b->execs);
+            regressed = 1;
+        }
+        return regressed;
+    }
+    printf("  no baseline entry for %s\n", name);
+    return 0;
+}
+
+// Write a synthetic script mixing plain commands, builtins, pipes, redirects and background jobs
+static int generate_script(const char *path, int lines) {
+    static const char *templates[] = {
+        "echo synthetic line %d",
+        "true",
+        "cat shell.c | grep void",
+        "ls -la | grep shell.c | wc -l",
+        "echo %d | cat | cat",
+        "echo redirected %d > /tmp/bench_replay_redirect.txt",
+        "true &",
+        "head -n 6 shell.c",
+        "plancache",
+    };
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("bench_replay: unable to create the generated script");
+        return -1;
+    }
+    unsigned int seed = 42;
+    for (int i = 0; i < lines; i++) {
+        seed = seed * 1103515245 + 12345;
+        fprintf(f, templates[(seed >> 16) % (sizeof(templates) / sizeof(templates[0]))], i);
+        fputc('\n', f);
+    }
+    return fclose(f);
+}
+
+int main(int argc, char **argv) {
+    const char *shell = "./myshell";
+    const char *baseline_path = NULL;
+    const char *save_path = NULL;
+    const char *generate_path = NULL;
+    double scale = 0;
+    double threshold_pct = DEFAULT_THRESHOLD_PCT;
+    int repeats = DEFAULT_REPEATS;
+    int generate_lines = 0;
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:x:r:b:w:t:g:o:v")) != -1) {
+        switch (opt) {
+        case 's': shell = optarg; break;
+        case 'x': scale = atof(optarg); break;
+        case 'r': repeats = atoi(optarg); break;
+        case 'b': baseline_path = optarg; break;
+        case 'w': save_path = optarg; break;
+        case 't': threshold_pct = atof(optarg); break;
+        case 'g': generate_lines = atoi(optarg); break;
+        case 'o': generate_path = optarg; break;
+        case 'v': verbose = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-s shell] [-x sleep_scale] [-r repeats] [-b baseline] [-w new_baseline] "
+                    "[-t threshold_pct] [-v] script...\n       %s -g lines -o generated_script\n", argv[0], argv[0]);
+            return 2;
+        }
+    }
+
+    if (generate_lines > 0) {
+        if (generate_path == NULL) {
+            fprintf(stderr, "bench_replay: -g needs -o\n");
+            return 2;
+        }
+        return generate_script(generate_path, generate_lines) == 0 ? 0 : 1;
+    }
+    if (optind == argc || repeats <= 0 || repeats > MAX_REPEATS) {
+        fprintf(stderr, "bench_replay: give at least one script and 1..%d repeats\n", MAX_REPEATS);
+        return 2;
+    }
+    if (access(shell, X_OK) != 0) {
+        fprintf(stderr, "bench_replay: %s is not executable\n", shell);
+        return 2;
+    }
+
+    struct baseline_entry *baseline = calloc(MAX_BASELINE, sizeof(struct baseline_entry));
+    int baseline_count = 0;
+    if (baseline_path != NULL && (baseline_count = load_baseline(baseline_path, baseline)) < 0) {
+        return 1;
+    }
+    FILE *save = NULL;
+    if (save_path != NULL && (save = fopen(save_path, "w")) == NULL) {
+        perror("bench_replay: unable to write the new baseline");
+        return 1;
+    }
+
+    int regressions = 0;
+    for (int s = optind; s < argc; s++) {
+        FILE *script = prepare_script(argv[s], scale);
+        if (script == NULL) {
+            return 1;
+        }
+
+        double wall[MAX_REPEATS], cpu[MAX_REPEATS];
+        struct measurement m;
+        for (int r = 0; r < repeats; r++) {
+            if (run_traced(shell, script, verbose, &m) != 0) {
+                return 1;
+            }
+            wall[r] = m.wall_sec;
+            cpu[r] = m.shell_cpu_sec;
+        }
+        fclose(script);
+        qsort(wall, repeats, sizeof(double), compare_double);
+        qsort(cpu, repeats, sizeof(double), compare_double);
+        m.wall_sec = wall[repeats / 2];
+        m.shell_cpu_sec = cpu[repeats / 2];
+
+        printf("%s: wall %.3f s  shell cpu %.4f s  forks %ld  execs %ld\n",
+               argv[s], m.wall_sec, m.shell_cpu_sec, m.forks, m.execs);
+        if (baseline_path != NULL) {
+            regressions += check_regression(argv[s], &m, baseline, baseline_count, threshold_pct);
+        }
+        if (save != NULL) {
+            fprintf(save, "%s %.6f %.6f %ld %ld\n", argv[s], m.wall_sec, m.shell_cpu_sec, m.forks, m.execs);
+        }
+    }
+
+    if (save != NULL && fclose(save) != 0) {
+        perror("bench_replay: unable to write the new baseline");
+        return 1;
+    }
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// bench_spawn - commands/sec and p50/p99 latency of the ways the shell could start a command
+// Build: gcc -O2 -o bench_spawn bench_spawn.c myshell.c
+//        gcc -Os -static -s -o bench_true bench_true.c
+// Usage: ./bench_spawn [-n iterations] [-s static_binary] [-m max_rss_mb] [-o output_prefix]
+// Writes <output_prefix>.csv and <output_prefix>.json (default prefix: bench_spawn)
+
+// The shell's entry point, so the fork+execvp row always measures the code in myshell.c
+int process_arglist(int count, char **arglist);
+
+extern char **environ;
+
+#define DEFAULT_ITERATIONS 2000
+#define WARMUP_ITERATIONS 50
+#define CLONE_STACK_SIZE (64 * 1024)
+
+struct result {
+    const char *method;
+    const char *target;
+    long rss_mb;
+    int iterations;
+    double cmds_per_sec;
+    double p50_us;
+    double p99_us;
+};
+
+typedef int (*spawn_fn)(const char *path);
+
+static char *clone_stack;
+static volatile int builtin_sink;
+
+// Helper function to read the monotonic clock in nanoseconds
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Helper function to wait for a benchmark child, treating a failed exec as a fatal setup error
+static int reap(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("bench_spawn: waitpid failed");
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench_spawn: child did not exit cleanly (status %d)\n", status);
+        return -1;
+    }
+    return 0;
+}
+
+// The current shell path: process_arglist -> execute_sync -> fork + execvp + waitpid
+static int spawn_shell(const char *path) {
+    char *arglist[2] = { (char *)path, NULL };
+    return process_arglist(1, arglist) ? 0 : -1;
+}
+
+static int spawn_vfork(const char *path) {
+    char *argv[2] = { (char *)path, NULL };
+    pid_t pid = vfork();
+    if (pid == -1) {
+        perror("bench_spawn: vfork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        execve(path, argv, environ);
+        _exit(127);
+    }
+    return reap(pid);
+}
+
+static int spawn_posix_spawn(const char *path) {
+    char *argv[2] = { (char *)path, NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, path, NULL, NULL, argv, environ);
+    if (err != 0) {
+        errno = err;
+        perror("bench_spawn: posix_spawn failed");
+        return -1;
+    }
+    return reap(pid);
+}
+
+// Child side of clone(CLONE_VM | CLONE_VFORK), runs on the borrowed stack until execve
+static int clone_child(void *arg) {
+    char *argv[2] = { (char *)arg, NULL };
+    execve((char *)arg, argv, environ);
+    return 127;
+}
+
+static int spawn_clone_vfork(const char *path) {
+    pid_t pid = clone(clone_child, clone_stack + CLONE_STACK_SIZE,
+                      CLONE_VM | CLONE_VFORK | SIGCHLD, (void *)path);
+    if (pid == -1) {
+        perror("bench_spawn: clone failed");
+        return -1;
+    }
+    return reap(pid);
+}
+
+// In-process dispatch floor: a name lookup and a call, as a shell builtin costs without a fork
+static int builtin_true(void) {
+    return builtin_sink = 0;
+}
+
+static const struct { const char *name; int (*fn)(void); } builtins[] = {
+    { "true", builtin_true },
+};
+
+// The builtin a target names by its basename, NULL when the shell would have to exec it
+static int (*find_builtin(const char *path))(void) {
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return builtins[i].fn;
+        }
+    }
+    return NULL;
+}
+
+static int spawn_builtin(const char *path) {
+    int (*fn)(void) = find_builtin(path);
+    if (fn == NULL) {
+        fprintf(stderr, "bench_spawn: %s is not a builtin\n", path);
+        return -1;
+    }
+    return fn();
+}
+
+static const struct { const char *name; spawn_fn fn; } methods[] = {
+    { "fork_execvp", spawn_shell },
+    { "vfork", spawn_vfork },
+    { "posix_spawn", spawn_posix_spawn },
+    { "clone_vfork", spawn_clone_vfork },
+    { "builtin", spawn_builtin },
+};
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Run one method against one target and fill in the throughput and latency percentiles
+static int run_case(spawn_fn fn, const char *path, int iterations, long long *samples, struct result *res) {
+    for (int i = 0; i < WARMUP_ITERATIONS; i++) {
+        if (fn(path) != 0) {
+            return -1;
+        }
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        long long t0 = now_ns();
+        if (fn(path) != 0) {
+            return -1;
+        }
+        samples[i] = now_ns() - t0;
+    }
+    long long total = now_ns() - start;
+
+    qsort(samples, iterations, sizeof(samples[0]), compare_ll);
+    res->iterations = iterations;
+    res->cmds_per_sec = iterations / (total / 1e9);
+    res->p50_us = samples[iterations / 2] / 1e3;
+    res->p99_us = samples[(int)(iterations * 0.99)] / 1e3;
+    return 0;
+}
+
+// Grow the parent's resident set to the requested size by touching every page of a private mapping
+static char *inflate_rss(char *region, long *current_mb, long target_mb) {
+    if (region != NULL) {
+        munmap(region, *current_mb << 20);
+    }
+    *current_mb = 0;
+    region = mmap(NULL, target_mb << 20, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    memset(region, 1, target_mb << 20);
+    *current_mb = target_mb;
+    return region;
+}
+
+static int write_csv(const char *path, struct result *results, int count) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("bench_spawn: unable to open the CSV output");
+        return -1;
+    }
+    fprintf(f, "method,target,rss_mb,iterations,cmds_per_sec,p50_us,p99_us\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(f, "%s,%s,%ld,%d,%.1f,%.2f,%.2f\n", results[i].method, results[i].target,
+                results[i].rss_mb, results[i].iterations, results[i].cmds_per_sec,
+                results[i].p50_us, results[i].p99_us);
+    }
+    return fclose(f);
+}
+
+static int write_json(const char *path, struct result *results, int count) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("bench_spawn: unable to open the JSON output");
+        return -1;
+    }
+    fprintf(f, "[\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(f, "  {\"method\": \"%s\", \"target\": \"%s\", \"rss_mb\": %ld, \"iterations\": %d, "
+                "\"cmds_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f}%s\n",
+                results[i].method, results[i].target, results[i].rss_mb, results[i].iterations,
+                results[i].cmds_per_sec, results[i].p50_us, results[i].p99_us,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(f, "]\n");
+    return fclose(f);
+}
+
+int main(int argc, char **argv) {
+    int iterations = DEFAULT_ITERATIONS;
+    const char *static_binary = "./bench_true";
+    const char *prefix = "bench_spawn";
+    long max_rss_mb = 4096;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:m:o:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        case 's': static_binary = optarg; break;
+        case 'm': max_rss_mb = atol(optarg); break;
+        case 'o': prefix = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s static_binary] [-m max_rss_mb] [-o output_prefix]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations <= 0) {
+        fprintf(stderr, "bench_spawn: iterations must be positive\n");
+        return 2;
+    }
+
+    const char *targets[2] = { "/bin/true", static_binary };
+    int num_targets = 2;
+    if (access(static_binary, X_OK) != 0) {
+        fprintf(stderr, "bench_spawn: %s is not executable, skipping the static target\n", static_binary);
+        num_targets = 1;
+    }
+
+    // The shell path is timed through process_arglist, which needs SIGCHLD left at SIG_DFL so waitpid sees the child
+    signal(SIGCHLD, SIG_DFL);
+
+    clone_stack = malloc(CLONE_STACK_SIZE);
+    long long *samples = malloc(sizeof(long long) * iterations);
+    int max_results = 16 * (int)(sizeof(methods) / sizeof(methods[0])) * num_targets;
+    struct result *results = calloc(max_results, sizeof(struct result));
+    if (clone_stack == NULL || samples == NULL || results == NULL) {
+        perror("bench_spawn: allocation failed");
+        return 1;
+    }
+
+    char *region = NULL;
+    long rss_mb = 0;
+    int count = 0;
+
+    // RSS ladder 1 MB, 4 MB, ... 4 GB: fork cost scales with the parent's page tables, vfork-style spawns should not
+    for (long target_mb = 1; target_mb <= max_rss_mb; target_mb *= 4) {
+        region = inflate_rss(region, &rss_mb, target_mb);
+        if (region == NULL) {
+            fprintf(stderr, "bench_spawn: unable to grow RSS to %ld MB, stopping the ladder\n", target_mb);
+            break;
+        }
+        for (int t = 0; t < num_targets; t++) {
+            for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+                // The builtin row only exists for targets a builtin stands in for, bench_true is not one
+                if (methods[m].fn == spawn_builtin && find_builtin(targets[t]) == NULL) {
+                    continue;
+                }
+                struct result *res = &results[count];
+                res->method = methods[m].name;
+                res->target = targets[t];
+                res->rss_mb = rss_mb;
+                if (run_case(methods[m].fn, targets[t], iterations, samples, res) != 0) {
+                    return 1;
+                }
+                printf("%-12s %-16s rss=%5ld MB  %10.1f cmds/s  p50=%8.2f us  p99=%8.2f us\n",
+                       res->method, res->target, res->rss_mb, res->cmds_per_sec, res->p50_us, res->p99_us);
+                fflush(stdout);
+                count++;
+            }
+        }
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.csv", prefix);
+    if (write_csv(path, results, count) != 0) {
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s.json", prefix);
+    if (write_json(path, results, count) != 0) {
+        return 1;
+    }
+    return 0;
+}
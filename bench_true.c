@@ -0,0 +1,5 @@
+// Tiny static target for bench_spawn, so exec cost is measured without the dynamic loader
+// Build: gcc -Os -static -s -o bench_true bench_true.c
+int main(void) {
+    return 0;
+}
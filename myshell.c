@@ -1,30 +1,874 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <poll.h>
 #include <string.h>
 #include <signal.h>
 
 
-int execute_sync(char **cmd_args);
-int execute_async(int num_args, char **cmd_args);
-int establish_pipe(int index, char **cmd_args);
-int setup_output_redirection(int num_args, char **cmd_args);
+// Number of parsed command lines kept by the plan cache
+#define PLAN_CACHE_SIZE 64
+
+// Most bytes the fan-out relay duplicates per round
+#define RELAY_CHUNK (1 << 20)
+
+// Pipelines and links per pipeline that set -o pipestat keeps statistics for
+#define MAX_PIPESTAT_PIPELINES 16
+#define MAX_PIPESTAT_LINKS 15
+
+// Counters of one pipe between two stages, written by the relay and read live by pipestat
+struct pipe_stat {
+    uint64_t bytes;
+    uint64_t splices;
+    uint64_t blocked_ns;    // Data waiting while the downstream stage's pipe was full
+    uint64_t starved_ns;    // Downstream ready while the upstream stage had written nothing
+};
+
+// A relayed pipeline, in memory shared between the shell and its relay
+struct pipeline_stat {
+    pid_t relay;            // 0 for a free slot
+    int running;
+    int num_links;
+    uint64_t started_ns;
+    uint64_t finished_ns;
+    char command[128];
+    struct pipe_stat links[MAX_PIPESTAT_LINKS];
+};
+
+// Relay state of one link: the upstream read end and the downstream write end
+struct relay_link {
+    int in;
+    int out;
+    int waiting;            // 0 ready to splice, 1 waiting for input, 2 waiting for room in the output
+    uint64_t since_ns;      // When the current wait began
+};
+
+// Where a job's processes run: '@cpus=' and '@numa=' prefixes, applied in each child before exec
+struct placement {
+    int pin_cpus;               // Set the affinity to cpus
+    cpu_set_t cpus;
+    unsigned long mem_nodes;    // Bind memory to these NUMA nodes, 0 for the default policy
+};
+
+// Resource limits and scheduling of a job: 'limit KEY=VALUE... cmd', applied in each child before exec
+#define LIMIT_MEM (1 << 0)
+#define LIMIT_NOFILE (1 << 1)
+#define LIMIT_CPU (1 << 2)
+#define LIMIT_NICE (1 << 3)
+#define LIMIT_SCHED (1 << 4)
+#define LIMIT_IONICE (1 << 5)
+
+struct limits {
+    int set;                    // LIMIT_* of the fields given
+    rlim_t mem;                 // RLIMIT_AS, bytes
+    rlim_t nofile;              // RLIMIT_NOFILE
+    rlim_t cpu;                 // RLIMIT_CPU, seconds
+    int nice;
+    int sched;                  // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+    int ioprio;                 // ioprio_set(2) value, class and level
+};
+
+// ioprio_set(2) has no glibc wrapper or header
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+// Accounting of a job's cgroup, every process that ran in it included
+struct cgroup_stats {
+    int valid;
+    uint64_t usage_usec;        // cpu.stat
+    uint64_t user_usec;
+    uint64_t system_usec;
+    uint64_t memory_peak;       // memory.peak, 0 without the memory controller
+    uint64_t read_bytes;        // io.stat, summed over devices; 0 without the io controller
+    uint64_t write_bytes;
+};
+
+// clone3(2) has no glibc wrapper; its arguments as of Linux 5.7, which added CLONE_INTO_CGROUP
+struct clone3_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+// Newer than the kernel headers of older systems: pidfd_send_signal to the target's whole process group
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+
+// set_mempolicy(2) mode, numaif.h is not always installed
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+// Exit status of a command stopped by 'timeout', as timeout(1) reports it
+#define TIMEOUT_STATUS 124
+
+// Background children watched for reaping, beyond this they are left as zombies
+#define MAX_BACKGROUND_CHILDREN 1024
+#define MAX_OWN_CHILDREN 1024
+// Monitor epoll data of the eventfd the SIGCHLD handler wakes it with, past the child and job timer slots
+#define MONITOR_ORPHANS (MAX_BACKGROUND_CHILDREN + MAX_JOBS)
+// ... and of the output pipes of set -o jobpipes, two per job slot: stdout, then stderr
+#define MONITOR_OUTPUT (MONITOR_ORPHANS + 1)
+// Longest partial line kept for a job's output stream, a longer one is emitted in pieces
+#define JOB_LINE_MAX 65536
+// Output kept per background job with set -o joblog, the most recent bytes
+#define JOB_LOG_SIZE (1 << 20)
+// Processes jtop samples at once, descendants of the background jobs included
+#define MAX_JTOP_PROCS 1024
+
+// Restart policies of 'supervise'
+#define RESTART_NONE 0
+#define RESTART_ALWAYS 1
+#define RESTART_ON_FAILURE 2
+
+// Delay before restarting a supervised job; --backoff=exp doubles it per quick exit, up to the cap
+#define SUPERVISE_DELAY_NS 100000000ULL
+#define SUPERVISE_MAX_DELAY_NS 30000000000ULL
+// A supervised instance that ran this long counts as healthy and resets the backoff
+#define SUPERVISE_STABLE_NS 10000000000ULL
+
+// What a job's timerfd does when it fires
+enum job_timer_action { TIMER_NONE, TIMER_RESTART, TIMER_SIGNAL, TIMER_KILL };
+
+// Jobs listed by 'jobs' and addressed as %n
+#define MAX_JOBS 64
+
+// A background or stopped job; its processes share one process group, so killpg signals them as a unit.
+// Guarded by jobs_lock, the job monitor thread updates it as its processes exit.
+struct job {
+    int id;                             // The n of %n, 0 marks a free slot
+    pid_t pgid;
+    int remaining;                      // Processes not reaped yet, plus one while a supervisor holds the job
+    int stopped;
+    char command[128];
+    uint64_t timeout_ns;                // 'timeout' of a background job, enforced by the job monitor
+    uint64_t kill_after_ns;
+    int timeout_signal;
+    int timer;                          // timerfd for the timeout and the restart delay, -1 until needed
+    enum job_timer_action timer_action;
+    // 'supervise ... &': each instance is the shell exec'd on a private copy of its words and environment
+    int restart;
+    int backoff;
+    int restarts;
+    int quick_exits;                    // Consecutive instances that did not run SUPERVISE_STABLE_NS, the backoff exponent
+    int stopping;                       // Set by kill %n, the current instance is the last
+    pid_t leader;                       // Current instance, 0 while waiting to restart
+    uint64_t started_ns;
+    uint64_t created_ns;                // When the job itself started, for jtop
+    char **instance_argv;               // 'myshell -c-instance WORDS...', see instance_argv
+    char **envp;
+    // Its cgroup under the shell's session cgroup, cgroup_name[0] is '\0' without one. Kept after the job's
+    // own processes are gone while descendants that escaped its process group still run in it.
+    int cgroup_fd;
+    char cgroup_name[32];
+    struct cgroup_stats stats;          // Read when the job's last process was reaped
+    struct cgroup_stats usage;          // Summed from the rusage of every process reaped, adopted orphans included
+    // set -o jobpipes or joblog: the read ends of its output pipes, drained by the monitor, bit i of
+    // output_open set while output[i] is open. With jobpipes stdout and stderr have a pipe each, emitted
+    // line by line with partial[i] holding the unterminated last line; with joblog alone both share one.
+    // A supervised job keeps the write ends for every instance it starts, until it ends.
+    int output_streams;
+    int output[2];
+    int output_open;
+    char *partial[2];
+    size_t partial_len[2];
+    int output_write[2];
+    int holds_output_write;
+    // set -o joblog: the last JOB_LOG_SIZE bytes of its output in a memfd used as a ring, log_head counting
+    // every byte written to it. Kept after the job ends, until its slot is reused.
+    int has_log;
+    int log_fd;
+    uint64_t log_head;
+};
+
+// A background process the job monitor reaps when its pidfd turns readable; pid 0 marks a free slot
+struct child_watch {
+    pid_t pid;
+    int pidfd;
+    struct job *job;
+};
+
+// A background process jtop samples: its /proc files are opened once and re-read with pread every interval,
+// and keep referring to it even if the pid is reused
+struct jtop_proc {
+    pid_t pid;
+    int job_id;
+    int stat_fd;
+    int statm_fd;
+    int io_fd;
+    int seen;
+    uint64_t ticks;                     // utime + stime at the last sample
+    uint64_t rchar;
+    uint64_t wchar;
+};
+
+// Prefixed lines of set -o jobpipes, queued under jobs_lock and written out once it is dropped
+struct emitted_lines {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+typedef int (*builtin_fn)(int argc, char **argv, FILE *out);
+
+// A single command of a pipeline, with its redirections and resolved executable
+struct stage {
+    char **argv;            // NULL terminated argument list
+    int argc;
+    char *path;             // Executable found on PATH when the plan was built, NULL to fall back to execvp
+    builtin_fn builtin;     // Shell-internal command, run without exec
+    char *input_file;       // Target of '<', or NULL
+    char *output_file;      // Target of '>', or NULL
+};
+
+// Fully parsed execution plan of one command line
+struct plan {
+    struct stage *stages;
+    int num_stages;
+    int fanout;             // First branch of 'cmd |& { a , b }', 0 when the pipeline does not fan out
+    int background;
+    uint64_t timeout_ns;    // 'timeout DURATION' prefix, 0 when the job runs unbounded
+    uint64_t kill_after_ns; // Its '-k GRACE', SIGKILL follows this long after the signal; 0 for never
+    int timeout_signal;     // Its '-s SIGNAL', SIGTERM by default
+    int restart;            // 'supervise --restart=' policy, RESTART_NONE when not supervised
+    int backoff;            // 'supervise --backoff=exp'
+    struct placement placement;
+    struct limits limits;   // 'limit' prefix
+    const char *cpus_spec;  // '@cpus=' and '@numa=' as written, for format_plan
+    const char *numa_spec;
+    int spread;             // '@spread': the next CPU, or NUMA node, in turn
+    int optimized;          // optimize_plan rewrote it, set -o explain reports that on every run
+    char *arena;            // The line's tokens, NUL separated; also the plan cache key
+    size_t arena_len;
+    char **argv_pool;       // Backing storage for every stage's argv
+};
+
+struct plan_cache_entry {
+    uint64_t hash;
+    struct plan *plan;
+    unsigned long last_used;
+};
+
+struct builtin {
+    const char *name;
+    builtin_fn fn;
+};
+
+enum node_type { NODE_COMMAND, NODE_SEQUENCE, NODE_AND, NODE_OR };
+
+// Node of a command list: a pipeline leaf, or ';', '&&' or '||' joining two sub-lists
+struct list_node {
+    enum node_type type;
+    int first;              // NODE_COMMAND: the pipeline's token range
+    int count;
+    struct list_node *left;
+    struct list_node *right;
+};
+
+struct list_parser {
+    char **tokens;
+    int num_tokens;
+    int pos;
+    struct list_node *nodes;
+    int num_nodes;
+    const char *error;      // Token the parser stopped at, NULL while the line is well formed
+};
+
+// Nesting limits of the control flow compiler and VM
+#define MAX_LOOP_DEPTH 64
+#define MAX_CALL_DEPTH 256
+
+enum opcode {
+    OP_EXEC,            // Run the pipeline in tokens [a, a + b); c is set when its words need expansion
+    OP_JUMP,            // Continue at a
+    OP_JUMP_IF_FAIL,    // Continue at a when the last status is non-zero
+    OP_JUMP_IF_OK,      // Continue at a when the last status is zero
+    OP_FOR_INIT,        // Push a loop over the words in tokens [b, b + c), or the positional parameters when b is -1
+    OP_FOR_NEXT,        // Assign the innermost loop's next word to its variable, or pop the loop and continue at a
+    OP_UNWIND,          // break/continue: pop b for-loops and continue at a
+    OP_DEFINE,          // Define function tokens[a] with its body at b
+    OP_LOCAL,           // Declare function locals from tokens [a, a + b)
+    OP_RETURN,          // Leave the function, with status tokens[a] unless a is -1
+    OP_KEEP_STATUS,     // Keep the last status, or b unless it is -1, in while-loop slot a
+    OP_LOAD_STATUS,     // Make while-loop slot a the last status
+    OP_HALT
+};
+
+struct op {
+    int32_t opcode;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+};
+
+// Compiled control flow. Ops refer to tokens by index and tokens are offsets into one string block,
+// so a program holds no pointers of its own
+struct program {
+    struct op *ops;
+    int num_ops;
+    uint32_t *tokens;
+    int num_tokens;
+    char *strings;
+    uint32_t strings_len;
+    int defines_functions;  // Function bodies point into the program, so it outlives the line
+    void *mapping;          // Precompiled script the arrays above point into, NULL when they are malloc'd
+    size_t mapping_len;
+};
+
+// On-disk form of a program: this header, then the ops, token offsets and string block at the recorded
+// offsets. Nothing in the file is a pointer, so a private mapping of it is run in place.
+#define MSHC_MAGIC "MSHC"
+#define MSHC_VERSION 2          // Bumped whenever the opcodes or struct op change
+#define MSHC_BYTE_ORDER 0x01020304
+
+struct mshc_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;    // MSHC_BYTE_ORDER as the compiling host stored it
+    uint32_t num_ops;
+    uint32_t num_tokens;
+    uint32_t strings_len;
+    uint32_t ops_offset;
+    uint32_t tokens_offset;
+    uint32_t strings_offset;
+};
+
+// A loop being compiled, with the chain of break jumps still waiting for its exit address
+struct loop_context {
+    int is_for;
+    int continue_target;
+    int break_chain;        // Index of the last unpatched break op, each op's a links to the previous one
+};
+
+struct compiler {
+    struct list_parser parser;
+    struct program *prog;
+    int ops_capacity;
+    struct loop_context loops[MAX_LOOP_DEPTH];
+    int loop_depth;
+    int function_depth;
+};
+
+// Runtime state of a for-loop
+struct loop_record {
+    char **words;
+    int count;
+    int index;
+    const char *name;
+};
+
+struct function {
+    char *name;
+    const struct program *prog;
+    int entry;
+};
+
+// Positional parameters of a running function
+struct frame {
+    int argc;
+    char **argv;
+};
+
+// Slot of the variable table
+struct shell_var {
+    char *name;             // NULL for an empty slot
+    char *value;            // NULL while unset
+    uint32_t hash;
+    int depth;              // Call depth of the innermost declaration, 0 for globals
+    int exported;
+};
+
+// Binding hidden by a function local or a command's NAME=VALUE prefix, put back when that ends
+struct saved_var {
+    const char *name;
+    char *value;
+    int depth;
+    int exported;
+    int owner_depth;        // Call depth whose return restores it, -1 for command prefixes
+};
+
+// Lines of a compound command that is still open, joined with ';' until it closes
+struct pending_input {
+    char **tokens;
+    int count;
+    int capacity;
+    int depth;
+};
+
+struct word_list {
+    char **words;
+    int count;
+    int capacity;
+};
+
+// Directory listings kept for globbing
+#define GLOB_CACHE_SIZE 64
+
+// Names in one directory as getdents64 returned them, valid while the directory's mtime is unchanged
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *block;            // The names, NUL separated
+    char **names;
+    unsigned char *types;   // d_type of each name, DT_UNKNOWN when the filesystem does not say
+    int count;
+    int pins;               // Walks currently iterating it, a pinned listing is never evicted
+    int cached;
+    unsigned long last_used;
+};
+
+// Threads of the parallel '**' walker
+#define MAX_GLOB_THREADS 8
+
+// Directory waiting to be walked, with its path as it is printed
+struct walk_item {
+    int fd;
+    char *prefix;
+};
+
+// Work queue of one walker thread: the owner pushes and pops at the tail, idle threads steal from the head
+struct walk_queue {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    int head;
+    int tail;
+    int capacity;
+};
+
+// One '**' expansion shared by the walker threads; the rest of the pattern is matched in every directory
+struct glob_walk {
+    struct walk_queue queues[MAX_GLOB_THREADS];
+    struct word_list matches[MAX_GLOB_THREADS];
+    int num_threads;
+    atomic_int pending;     // Items queued or being walked, the walk is over when it drops to zero
+    atomic_uint queued;     // Bumped under idle_lock whenever an item is queued or the walk ends
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_wake;   // Threads with nothing to take wait here instead of spinning
+    char **components;
+    int num_components;
+    int idx;                // Component after the '**'
+    int dirs_only;
+};
+
+struct walk_worker {
+    struct glob_walk *walk;
+    int id;
+};
+
+// Record layout of the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct list_node *parse_list(struct list_parser *parser);
+struct list_node *parse_and_or(struct list_parser *parser);
+struct list_node *parse_pipeline(struct list_parser *parser);
+struct list_node *new_list_node(struct list_parser *parser, enum node_type type);
+int is_list_operator(const char *token);
+int is_pipeline_operator(const char *token);
+int run_list(struct list_node *node, char **tokens);
+int scan_control_flow(int num_args, char **cmd_args, int *needs_compiler);
+int queue_pending_line(int num_args, char **cmd_args, int depth);
+int run_pending_program(void);
+void clear_pending_input(void);
+struct program *compile_program(char **tokens, int num_tokens);
+void free_program(struct program *prog);
+int compile_script(const char *source, const char *output);
+int write_program(const struct program *prog, const char *output);
+struct program *load_program(const char *path);
+int validate_program(const struct program *prog);
+int validate_loop_depth(const struct program *prog);
+int reach_op(int *depth_at, int *pending, int *num_pending, int pc, int depth);
+void retain_program(struct program *prog);
+int emit_op(struct compiler *c, int opcode, int a, int b, int d);
+void patch_chain(struct compiler *c, int chain, int target);
+int at_keyword(struct compiler *c, const char *keyword);
+void expect_keyword(struct compiler *c, const char *keyword);
+void compile_statements(struct compiler *c, const char *const *terminators);
+void compile_statement(struct compiler *c);
+void compile_node(struct compiler *c, struct list_node *node);
+void compile_control(struct compiler *c, struct list_node *node);
+void compile_if(struct compiler *c);
+void compile_while(struct compiler *c);
+void compile_for(struct compiler *c);
+void compile_function(struct compiler *c);
+void compile_local(struct compiler *c);
+int vm_run(const struct program *prog, int pc);
+int vm_exec(const struct program *prog, const struct op *op);
+const char *program_token(const struct program *prog, int index);
+int call_function(struct function *fn, int argc, char **argv);
+struct function *find_function(const char *name);
+void define_function(const char *name, const struct program *prog, int entry);
+int expand_words(char **tokens, int count, struct word_list *out);
+void expand_word(const char *token, struct word_list *out);
+void append_word(struct word_list *list, char *word);
+void free_word_list(struct word_list *list);
+int word_needs_expansion(const char *token);
+int has_glob_chars(const char *word);
+int glob_word(const char *pattern, struct word_list *out);
+void glob_dir(int dirfd, const char *prefix, char **components, int num_components, int idx, int dirs_only,
+              struct word_list *matches);
+void glob_emit(const char *prefix, const char *name, int dirs_only, struct word_list *matches);
+int glob_match(const char *pattern, const char *name);
+void glob_walk_parallel(int dirfd, const char *prefix, char **components, int num_components, int idx,
+                        int dirs_only, struct word_list *matches);
+void *glob_walker(void *arg);
+void glob_walk_dir(struct glob_walk *walk, int id, struct walk_item *item);
+void walk_push(struct glob_walk *walk, int id, int fd, char *prefix);
+void walk_wake(struct glob_walk *walk, int all);
+int walk_take(struct walk_queue *queue, struct walk_item *item, int steal);
+int glob_is_dir(int dirfd, const struct dir_listing *listing, int i, int follow);
+struct dir_listing *read_dir(int fd);
+void release_dir(struct dir_listing *listing);
+void free_dir_listing(struct dir_listing *listing);
+int compare_words(const void *a, const void *b);
+int is_valid_name(const char *name, size_t len);
+int is_assignment(const char *token);
+uint32_t hash_name(const char *name);
+struct shell_var *find_var(const char *name, int create);
+void grow_vars(void);
+void var_changed(const struct shell_var *var, int was_exported);
+void import_environment(void);
+char **get_envp(void);
+const char *get_var(const char *name);
+void set_var(const char *name, const char *value);
+void unset_var(const char *name);
+void save_var(struct shell_var *var, int depth);
+void restore_vars(int mark);
+void declare_local(const char *name, const char *value);
+void pop_locals(int depth);
+int builtin_export(int argc, char **argv, FILE *out);
+int builtin_unset(int argc, char **argv, FILE *out);
+int builtin_true(int argc, char **argv, FILE *out);
+int builtin_false(int argc, char **argv, FILE *out);
+int builtin_echo(int argc, char **argv, FILE *out);
+int echo_escapes(const char *arg, FILE *out);
+int builtin_pwd(int argc, char **argv, FILE *out);
+int join_substitutions(int num_args, char **cmd_args, char ***joined);
+void free_joined(int num_args, char **joined);
+const char *substitution_end(const char *p);
+const char *process_substitution_end(const char *p);
+const char *matching_paren(const char *p);
+char *process_substitution(const char *text, size_t len, int reading);
+void close_process_substitutions(void);
+char *command_substitution(const char *text, size_t len);
+int split_words(char *text, char ***words);
+int builtin_test(int argc, char **argv, FILE *out);
+int test_expression(int argc, char **argv);
+int execute_sync(struct stage *stage);
+int execute_async(struct stage *stage);
+int establish_pipe(struct plan *plan);
+int start_fanout(struct plan *plan, int input, pid_t *pids);
+int establish_relayed_pipe(struct plan *plan);
+struct pipeline_stat *claim_pipeline_stat(const struct plan *plan);
+void splice_relay(int *inputs, int *outputs, int count, struct pipeline_stat *stat);
+void relay_wait(int epfd, struct relay_link *link, int index, int waiting, struct pipe_stat *stat);
+uint64_t monotonic_ns(void);
+int builtin_pipestat(int argc, char **argv, FILE *out);
+void fanout_relay(int input, int *outputs, int count);
+int write_all(int fd, const char *buf, size_t len);
+int run_plan(struct plan *plan);
+struct plan *build_plan(int num_args, char **cmd_args);
+int parse_job_prefixes(struct plan *plan, char **tokens, int end);
+int parse_duration(const char *text, uint64_t *ns);
+int parse_id_list(const char *text, cpu_set_t *set);
+int read_id_list(const char *path, cpu_set_t *set);
+int add_node_cpus(int node, cpu_set_t *cpus);
+void spread_placement(struct placement *placement);
+void apply_placement(const struct placement *placement);
+int parse_limit(const char *text, struct limits *limits);
+int parse_size(const char *text, rlim_t *size);
+void merge_limits(struct limits *limits, const struct limits *defaults);
+void apply_limits(const struct limits *limits);
+void format_limits(const struct limits *limits, FILE *out);
+int builtin_limit(int argc, char **argv, FILE *out);
+int job_cgroups_active(void);
+int setup_cgroup_session(void);
+int find_cgroup_root(char *path, size_t size);
+int create_job_cgroup(void);
+pid_t fork_into_job(const struct stage *stage);
+pid_t fork_into_cgroup(int cgroup_fd, int will_exec);
+void read_cgroup_stats(int cgroup_fd, struct cgroup_stats *stats);
+int read_cgroup_file(int cgroup_fd, const char *name, char *buf, size_t size);
+uint64_t cgroup_value(const char *text, const char *key);
+void release_job_cgroup(struct job *job);
+void remove_cgroup_session(void);
+void format_cgroup_stats(const struct cgroup_stats *stats, FILE *out);
+const char *human_size(uint64_t bytes, char *buf, size_t size);
+int builtin_jobstat(int argc, char **argv, FILE *out);
+int builtin_jtop(int argc, char **argv, FILE *out);
+int collect_jtop_procs(struct jtop_proc *procs, int count);
+int track_jtop_proc(struct jtop_proc *procs, int count, pid_t pid, int job_id);
+int sample_jtop_proc(struct jtop_proc *proc, char *state, uint64_t *ticks, uint64_t *rss, uint64_t *rchar, uint64_t *wchar);
+void format_runtime(uint64_t ns, char *buf, size_t size);
+int wait_for_timed_job(pid_t *pids, int count);
+void signal_job(int pidfd, int sig);
+struct plan *lookup_plan(int num_args, char **cmd_args);
+void free_plan(struct plan *plan);
+void flush_plan_cache(void);
+int optimize_plan(struct plan *plan);
+int is_plain_cat(const struct stage *stage);
+void remove_stage(struct plan *plan, int index);
+void format_plan(const struct plan *plan, FILE *out);
+int builtin_copy(int argc, char **argv, FILE *out);
+int builtin_set(int argc, char **argv, FILE *out);
+uint64_t hash_arglist(int num_args, char **cmd_args);
+char *resolve_executable(const char *name);
+builtin_fn find_builtin(const char *name);
+int run_builtin(struct stage *stage);
+int builtin_plancache(int argc, char **argv, FILE *out);
 void error_handling(const char *message);
-void execute_child(int num_args, char **cmd_args);
+void execute_child(struct stage *stage);
 int wait_and_handle_error(pid_t child_pid, const char *error_message);
-void set_signal_handling_child();
-int open_and_redirect_file(char *filename);
-void set_signal_handling_child();
+void record_status(int status);
+void track_background_child(pid_t pid);
+pid_t fork_own_child(int cgroup_fd, int will_exec);
+int list_children(pid_t *children, int max);
+void prune_own_children(void);
+void adopt_orphans(void);
+struct job *orphan_job(pid_t pid);
+void sigchld_handler(int sig);
+void add_rusage(struct cgroup_stats *usage, const struct rusage *ru);
+void open_job_output(struct job *job, int supervised);
+void hand_over_job_output(struct job *job);
+void drain_job_output(struct job *job, int stream);
+void emit_job_lines(struct job *job, int stream, const char *data, size_t len);
+void queue_emitted(int stream, const void *data, size_t len);
+void flush_emitted_lines(void);
+void write_lines(int fd, struct iovec *iov, int count);
+void close_job_output(struct job *job, int stream);
+void release_job_output(struct job *job);
+ssize_t splice_job_log(struct job *job, int stream);
+void append_job_log(struct job *job, const char *data, size_t len);
+int copy_job_log(int log_fd, off_t offset, size_t len, FILE *out);
+int builtin_joblog(int argc, char **argv, FILE *out);
+void watch_child(pid_t pid, struct job *job);
+void *job_monitor(void *arg);
+void reap_watched_child(struct child_watch *watch);
+void job_process_done(struct job *job);
+void job_timer_fired(struct job *job);
+void arm_job_timer(struct job *job, uint64_t delay_ns, enum job_timer_action action);
+int start_supervised(struct plan *plan);
+void spawn_instance(struct job *job);
+void supervised_exit(struct job *job, int status);
+char **instance_argv(const struct plan *plan);
+char *format_id_list(const char *prefix, const cpu_set_t *set);
+int open_and_redirect_file(const char *filename, int flags, int target_fd);
+void apply_redirections(struct stage *stage);
 void set_child_signal_handling();
+void enter_job_group(pid_t pid, int background);
+int wait_for_job(pid_t *pids, int count);
+struct job *new_job(const struct plan *plan);
+struct job *find_job(const char *spec);
+void report_finished_jobs(void);
+int parse_signal(const char *name);
+void describe_plan(const struct plan *plan, char *buf, size_t size);
+int builtin_jobs(int argc, char **argv, FILE *out);
+int builtin_kill(int argc, char **argv, FILE *out);
 void redirect_stdout_to_pipe(int pipefd_write);
 void redirect_stdin_from_pipe(int pipefd_read);
-void close_pipe_ends(int pipefd[2]);
 
 
+struct plan_cache_entry plan_cache[PLAN_CACHE_SIZE];
+unsigned long plan_cache_clock = 0;
+unsigned long plan_cache_hits = 0;
+unsigned long plan_cache_misses = 0;
+
+// Exit status of the last foreground command, drives '&&' and '||'
+int last_status = 0;
+
+// Set in forked children: they leave with _exit so stdio never flushes or rewinds the shell's shared stdin
+int is_child_process = 0;
+
+// Background children and jobs, shared with the job monitor thread that reaps them through their pidfds
+// and runs the jobs' timers from one epoll set. Started with the first background child.
+struct child_watch child_watches[MAX_BACKGROUND_CHILDREN];
+
+// The shell is a subreaper once the monitor runs: descendants of its jobs whose parent exits are reparented
+// to it. Every child the shell forks itself is listed here, under jobs_lock, so a child of the shell that
+// is in neither list nor child_watches is such an orphan. The SIGCHLD handler wakes the monitor to look.
+pid_t own_children[MAX_OWN_CHILDREN];
+int num_own_children = 0;
+int orphan_eventfd = -1;
+struct job jobs[MAX_JOBS];
+pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+int monitor_epfd = -1;
+
+// set -o jobpipes or joblog: the write ends the background job being started sends its stdout and stderr
+// to, each process forked for it puts them in place before its own pipes and redirections. Under jobs_lock.
+int job_output_fds[2] = { -1, -1 };
+// Where emitted job lines go: the shell's stdout and stderr, duplicated once so nothing ever swaps them.
+// emitted_lines fills under jobs_lock; whoever flushes swaps it with flushing_lines and writes that under
+// emit_lock alone, so a reader of the shell's output that stalls holds up nothing that needs jobs_lock.
+int job_line_fds[2] = { -1, -1 };
+struct emitted_lines emitted_lines[2];
+struct emitted_lines flushing_lines[2];
+pthread_mutex_t emit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set when the shell owns its terminal: foreground jobs then get their own process group and the terminal
+int job_control = 0;
+pid_t shell_pgid = 0;
+
+// Job being started or waited for: its process group, 0 until the first process is forked, and its plan.
+// A background job is in starting_job while its processes are tracked, which counts them into it.
+pid_t job_pgid = 0;
+int job_own_group = 0;
+const struct plan *job_plan = NULL;
+struct job *starting_job = NULL;
+
+// Placement of the job being started, its children apply it; '@spread' hands out targets in turn
+struct placement job_placement;
+unsigned int spread_next = 0;
+
+// Limits of the job being started, and the defaults 'limit --background' sets for every background job
+struct limits job_limits;
+struct limits background_limits;
+
+// cgroup v2 accounting: this shell's session cgroup under the delegated root, created on first use, and the
+// cgroup of the job being started. A child of the shell never sets up a session of its own.
+int cgroup_session_fd = -1;
+char cgroup_session_path[4096];
+int cgroup_unavailable = 0;
+unsigned long cgroup_seq = 0;
+int job_cgroup_fd = -1;
+char job_cgroup_name[32];
+
+// Accounting of the last foreground job that had a cgroup
+struct cgroup_stats last_job_stats;
+char last_job_command[128];
+
+// Compound command collected across lines
+struct pending_input pending = { NULL, 0, 0, 0 };
+
+// Shell and exported variables, an open addressing table keyed by name
+struct shell_var *shell_vars = NULL;
+size_t shell_vars_used = 0;
+size_t shell_vars_capacity = 0;
+
+struct saved_var *saved_vars = NULL;
+int num_saved_vars = 0;
+int saved_vars_capacity = 0;
+
+// Environment passed to exec'd commands, rebuilt on the next command after an exported variable changed
+char **shell_envp = NULL;
+int envp_dirty = 1;
+
+// Set when PATH changed, the cached plans hold executables resolved against the old one
+int plan_cache_stale = 0;
+
+// set -o options
+int option_optimize = 0;    // Rewrite plans with the peephole rules in optimize_plan
+int option_explain = 0;     // Report every rewrite on stderr
+int option_pipestat = 0;    // Pipelines go through a splice relay that measures every pipe
+int option_cgroups = 0;     // Every job gets a cgroup of its own for accounting, see job_cgroups_active
+int option_jobpipes = 0;    // Background jobs write into pipes the shell emits as lines prefixed with [n]
+int option_joblog = 0;      // The shell keeps the last output of every background job for joblog; alone, it
+                            // captures the output instead of showing it
+
+struct shell_option {
+    const char *name;
+    int *value;
+};
+
+const struct shell_option shell_options[] = {
+    { "cgroups", &option_cgroups },
+    { "explain", &option_explain },
+    { "joblog", &option_joblog },
+    { "jobpipes", &option_jobpipes },
+    { "optimize", &option_optimize },
+    { "pipestat", &option_pipestat },
+};
+
+// MAP_SHARED, so relays write into it and the shell reads it while they run; mapped on first use
+struct pipeline_stat *pipeline_stats = NULL;
+
+struct dir_listing *glob_cache[GLOB_CACHE_SIZE];
+unsigned long glob_cache_clock = 0;
+pthread_mutex_t glob_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Pipe ends of <(...) and >(...) held for the command being expanded, closed once it has started
+#define MAX_PROCESS_SUBSTITUTIONS 32
+int process_substitution_fds[MAX_PROCESS_SUBSTITUTIONS];
+int num_process_substitutions = 0;
+
+// Set in the '**' walker threads, a nested '**' there is walked by that thread alone
+__thread int in_glob_walker = 0;
+
+struct function *functions = NULL;
+int num_functions = 0;
+
+// Programs that define functions, kept until the shell exits
+struct program **retained_programs = NULL;
+int num_retained_programs = 0;
+
+struct frame frames[MAX_CALL_DEPTH];
+int call_depth = 0;
+
+const struct builtin builtins[] = {
+    { "plancache", builtin_plancache },
+    { "true", builtin_true },
+    { ":", builtin_true },
+    { "false", builtin_false },
+    { "test", builtin_test },
+    { "[", builtin_test },
+    { "export", builtin_export },
+    { "unset", builtin_unset },
+    { "echo", builtin_echo },
+    { "pwd", builtin_pwd },
+    { "set", builtin_set },
+    { "pipestat", builtin_pipestat },
+    { "jobs", builtin_jobs },
+    { "kill", builtin_kill },
+    { "limit", builtin_limit },
+    { "jobstat", builtin_jobstat },
+    { "jtop", builtin_jtop },
+    { "joblog", builtin_joblog },
+};
+
 
 
 
@@ -46,304 +890,6101 @@ int prepare(void) {
         return -1;
     }
 
-    // Applying the same handler to SIGCHLD enables automatic collection of child process statuses so there are no zombies
-    if (sigaction(SIGCHLD, &sa_ignore, NULL) == -1) {
-        perror("Unable to set handler for SIGCHLD");
+    // SIGCHLD stays at its default: background children are reaped by the job monitor thread through their
+    // pidfds, foreground ones by the waitpid of whoever started them
+
+    // With job control the shell hands its terminal to each foreground job and takes it back with tcsetpgrp,
+    // which it may only do from outside the terminal's process group while SIGTTOU is ignored
+    if (sigaction(SIGTTOU, &sa_ignore, NULL) == -1) {
+        perror("Unable to set handler for SIGTTOU");
         return -1;
     }
+    shell_pgid = getpgrp();
+    job_control = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shell_pgid;
 
-    // Signal handlers are configured, the shell is now protected against SIGINT and zombies.
+    // Signal handlers are configured, the shell is now protected against SIGINT.
     return 0;
 }
 
 
 int process_arglist(int num_args, char **cmd_args) {
-    int background_flag = 0;
+    if (job_control) {
+        report_finished_jobs();
+    }
 
-    // Check if the last argument is '&', indicating background execution
-    if (num_args > 0 && strcmp(cmd_args[num_args - 1], "&") == 0) {
-        background_flag = 1;
-        cmd_args[num_args - 1] = NULL; // Remove '&' from the argument list
-        num_args--; // Decrement the argument num_args
+    // $(...) and `...` were split at their spaces by the line reader, run them as the one word they are
+    char **joined;
+    int num_joined = join_substitutions(num_args, cmd_args, &joined);
+    if (joined != NULL) {
+        int result = process_arglist(num_joined, joined);
+        free_joined(num_joined, joined);
+        return result;
     }
 
-    // Check for piping and redirection
-    int pipe_index = -1;
-    int redirect_index = -1;
+    // Control flow, functions and variables go through the compiler, possibly over several lines
+    int needs_compiler = 0;
+    int depth = scan_control_flow(num_args, cmd_args, &needs_compiler);
+    if (pending.count > 0 || needs_compiler) {
+        if (!queue_pending_line(num_args, cmd_args, depth)) {
+            return 1; // The compound command is still open, wait for its next line
+        }
+        return run_pending_program();
+    }
 
-    for (int i = 0; i < num_args; i++) {
-        if (strcmp(cmd_args[i], "|") == 0) {
-            pipe_index = i;
+    // Parse the line into a list of pipelines joined by ';', '&&' and '||'
+    struct list_parser parser = { cmd_args, num_args, 0, NULL, 0, NULL };
+    parser.nodes = malloc(sizeof(struct list_node) * (2 * num_args + 1));
+    if (parser.nodes == NULL) {
+        error_handling("Error - failed allocating the command list");
+        return 0;
+    }
+
+    struct list_node *root = parse_list(&parser);
+    if (parser.error != NULL) {
+        // Syntax errors are reported, the shell keeps accepting commands
+        fprintf(stderr, "myshell: syntax error near '%s'\n", parser.error);
+        last_status = 2;
+        free(parser.nodes);
+        return 1;
+    }
+
+    // Run the list in the shell itself, exit statuses decide which pipelines run
+    int result = run_list(root, cmd_args);
+    free(parser.nodes);
+    return result;
+} 
+
+int is_list_operator(const char *token) {
+    return strcmp(token, ";") == 0 || strcmp(token, "&&") == 0 || strcmp(token, "||") == 0;
+}
+
+// Tokens that make a pipeline more than one plain command
+int is_pipeline_operator(const char *token) {
+    return strcmp(token, "|") == 0 || strcmp(token, "|&") == 0 || strcmp(token, "<") == 0 ||
+           strcmp(token, ">") == 0 || strcmp(token, "&") == 0;
+}
+
+struct list_node *new_list_node(struct list_parser *parser, enum node_type type) {
+    struct list_node *node = &parser->nodes[parser->num_nodes++];
+    node->type = type;
+    node->first = node->count = 0;
+    node->left = node->right = NULL;
+    return node;
+}
+
+// list := and_or ((';' | '&') and_or)* [';']
+struct list_node *parse_list(struct list_parser *parser) {
+    struct list_node *root = parse_and_or(parser);
+    while (parser->error == NULL && parser->pos < parser->num_tokens) {
+        // A pipeline ending in '&' already separates it from the next one
+        if (strcmp(parser->tokens[parser->pos], ";") == 0) {
+            parser->pos++;
+        } else if (strcmp(parser->tokens[parser->pos - 1], "&") != 0) {
+            parser->error = parser->tokens[parser->pos];
             break;
-        } else if (strcmp(cmd_args[i], ">") == 0) {
-            redirect_index = i;
+        }
+        if (parser->pos == parser->num_tokens) {
             break;
         }
+        struct list_node *node = new_list_node(parser, NODE_SEQUENCE);
+        node->left = root;
+        node->right = parse_and_or(parser);
+        root = node;
     }
+    return root;
+}
 
-    // Execute based on the presence of pipes or redirection
-    if (pipe_index != -1) {
-        // Handle pipe
-        return establish_pipe(pipe_index, cmd_args);
-    } else if (redirect_index != -1) {
-        // Handle output redirection
-        return setup_output_redirection(num_args, cmd_args);
-    } else {
-        // No piping or redirection, execute normally
-        if (background_flag) {
-            // Execute asynchronously
-            return execute_async(num_args, cmd_args);
+// and_or := pipeline (('&&' | '||') pipeline)*, left associative
+struct list_node *parse_and_or(struct list_parser *parser) {
+    struct list_node *root = parse_pipeline(parser);
+    while (parser->error == NULL && parser->pos < parser->num_tokens &&
+           strcmp(parser->tokens[parser->pos - 1], "&") != 0) {
+        const char *op = parser->tokens[parser->pos];
+        enum node_type type;
+        if (strcmp(op, "&&") == 0) {
+            type = NODE_AND;
+        } else if (strcmp(op, "||") == 0) {
+            type = NODE_OR;
         } else {
-            // Execute synchronously
-            return execute_sync(cmd_args);
+            break;
         }
+        parser->pos++;
+        struct list_node *node = new_list_node(parser, type);
+        node->left = root;
+        node->right = parse_pipeline(parser);
+        root = node;
     }
-} 
-
-
-int finalize(void) {
-    return 0;
+    return root;
 }
 
-// External error handling function
-void error_handling(const char *message) {
-    perror(message);
-    exit(EXIT_FAILURE);
+// pipeline := every token up to the next list operator, including a trailing '&'
+struct list_node *parse_pipeline(struct list_parser *parser) {
+    struct list_node *node = new_list_node(parser, NODE_COMMAND);
+    node->first = parser->pos;
+    while (parser->pos < parser->num_tokens && !is_list_operator(parser->tokens[parser->pos])) {
+        if (strcmp(parser->tokens[parser->pos++], "&") == 0) {
+            break;
+        }
+    }
+    node->count = parser->pos - node->first;
+    if (node->count == 0) {
+        parser->error = parser->pos < parser->num_tokens ? parser->tokens[parser->pos] : "newline";
+    }
+    return node;
 }
 
-int execute_sync(char **cmd_args) {
-    // Spawn a child process to execute the command, then wait for its completion before accepting another command
-    pid_t child_pid = fork();
-    if (child_pid == -1) { // Forking was failed
-        error_handling("Failed to create a child process");
-        return 0; // An error occurred in the original process, causing process_arglist to return 0
-    
-     // Child process handling
-    } else if (child_pid == 0) { 
-        // Set up signal handling for the child process
-        if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
-            // Handle SIGINT in foreground child processes
-            error_handling("Failed to adjust SIGINT handling in the child process");
+// Walk the list, short-circuiting '&&' and '||' on the last exit status
+int run_list(struct list_node *node, char **tokens) {
+    switch (node->type) {
+    case NODE_COMMAND: {
+        // A repeated pipeline reuses its cached plan, so it goes straight to spawning
+        struct plan *plan = lookup_plan(node->count, tokens + node->first);
+        if (plan == NULL) {
+            last_status = 2;
+            return 1;
         }
-        if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
-            // Revert to the default SIGCHLD handling if execvp doesn't alter signal configurations
-            error_handling("Failed to adjust SIGCHLD handling in the child process");
+        // Execute based on the presence of pipes, builtins or background execution
+        return run_plan(plan);
+    }
+    case NODE_SEQUENCE:
+        return run_list(node->left, tokens) && run_list(node->right, tokens);
+    case NODE_AND:
+        if (!run_list(node->left, tokens)) {
+            return 0;
         }
-        // Execute the command in the child process
-        if (execvp(cmd_args[0], cmd_args) == -1) {
-            error_handling("Failed to execute the command in the child process");
+        return last_status == 0 ? run_list(node->right, tokens) : 1;
+    case NODE_OR:
+        if (!run_list(node->left, tokens)) {
+            return 0;
         }
+        return last_status != 0 ? run_list(node->right, tokens) : 1;
     }
+    return 1;
+}
 
-    
-    // Parent process handling
-    // Wait for the child process to complete
-    if (waitpid(child_pid, NULL, 0) == -1 && errno != ECHILD && errno != EINTR) {
-        // Ignore ECHILD and EINTR in the parent shell after waitpid, as they are not treated as errors
-        error_handling("Failed to wait for the child process");
-        return 0; // An error occurred in the original process, causing process_arglist to return 0
+
+// Scan a line for control flow at command positions. Returns how many compound commands it opens
+// (negative when it closes more), and sets needs_compiler when the line cannot run as a plain list
+int scan_control_flow(int num_args, char **cmd_args, int *needs_compiler) {
+    int depth = 0;
+    int command_position = 1;
+    int after_function_keyword = 0;
+
+    for (int i = 0; i < num_args; i++) {
+        const char *tok = cmd_args[i];
+        int next_command_position = 0;
+
+        if (word_needs_expansion(tok)) {
+            *needs_compiler = 1;
+        }
+        if (after_function_keyword) {
+            // The function name, its '{' follows as if at command position
+            after_function_keyword = 0;
+            next_command_position = 1;
+        } else if (command_position) {
+            size_t len = strlen(tok);
+            if (strcmp(tok, "if") == 0 || strcmp(tok, "while") == 0 || strcmp(tok, "until") == 0) {
+                depth++;
+                next_command_position = 1;
+                *needs_compiler = 1;
+            } else if (strcmp(tok, "for") == 0) {
+                depth++;
+                *needs_compiler = 1;
+            } else if (strcmp(tok, "fi") == 0 || strcmp(tok, "done") == 0 || strcmp(tok, "}") == 0) {
+                depth--;
+                *needs_compiler = 1;
+            } else if (strcmp(tok, "{") == 0) {
+                depth++;
+                next_command_position = 1;
+                *needs_compiler = 1;
+            } else if (strcmp(tok, "then") == 0 || strcmp(tok, "do") == 0 || strcmp(tok, "else") == 0 ||
+                       strcmp(tok, "elif") == 0) {
+                next_command_position = 1;
+                *needs_compiler = 1;
+            } else if (strcmp(tok, "function") == 0) {
+                after_function_keyword = 1;
+                *needs_compiler = 1;
+            } else if (len > 2 && strcmp(tok + len - 2, "()") == 0) {
+                next_command_position = 1;
+                *needs_compiler = 1;
+            } else if (is_assignment(tok)) {
+                next_command_position = 1;
+                *needs_compiler = 1;
+            } else if (strcmp(tok, "break") == 0 || strcmp(tok, "continue") == 0 ||
+                       strcmp(tok, "return") == 0 || strcmp(tok, "local") == 0 || find_function(tok) != NULL) {
+                *needs_compiler = 1;
+            }
+        }
+        if (strcmp(tok, ";") == 0 || strcmp(tok, "&&") == 0 || strcmp(tok, "||") == 0 ||
+            strcmp(tok, "&") == 0 || strcmp(tok, "|") == 0) {
+            next_command_position = 1;
+        }
+        command_position = next_command_position;
     }
-    return 1; // No errors occurred in the parent, allowing the shell to handle another command
+    return depth;
 }
 
+// Add a line to the compound command being collected; returns 1 once it is complete
+int queue_pending_line(int num_args, char **cmd_args, int depth) {
+    pending.depth += depth;
 
-void execute_child(int num_args, char **cmd_args) {
+    if (pending.count + num_args + 1 > pending.capacity) {
+        pending.capacity = 2 * (pending.count + num_args + 1);
+        pending.tokens = realloc(pending.tokens, sizeof(char *) * pending.capacity);
+        if (pending.tokens == NULL) {
+            error_handling("Error - failed allocating the pending command");
+        }
+    }
+    // Lines are joined with ';', the caller frees its line after this call so every token is copied
+    if (pending.count > 0) {
+        pending.tokens[pending.count++] = strdup(";");
+    }
+    for (int i = 0; i < num_args; i++) {
+        pending.tokens[pending.count++] = strdup(cmd_args[i]);
+    }
+    return pending.depth <= 0;
+}
 
-    // Restore default SIGCHLD handling in case execvp doesn't modify signals
-    if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
-        error_handling("Error: Unable to reset the SIGCHLD signal handling");
+// Compile the collected lines and run them in the VM
+int run_pending_program(void) {
+    struct program *prog = compile_program(pending.tokens, pending.count);
+    clear_pending_input();
+    if (prog == NULL) {
+        last_status = 2;
+        return 1;
     }
 
-    // Execute the command in the child process
-    if (execvp(cmd_args[0], cmd_args) == -1) {
-        error_handling("Error - execution of the command failed");
+    int result = vm_run(prog, 0);
+
+    // Function bodies stay referenced after the line is done
+    if (prog->defines_functions) {
+        retain_program(prog);
+    } else {
+        free_program(prog);
     }
+    return result;
 }
 
-// Execute a command asynchronously, spawning a child process
-int execute_async(int num_args, char **cmd_args) {
-    // Fork to create a child process that executes the command without waiting for completion
-    pid_t child_pid = fork();
-    if (child_pid == -1) { // Forking failed
-        error_handling("Error: Unable to create a new process");
-        return 0; // Error in the original process, causing process_arglist to return 0
-     
-     // Child process handling
-    }else if (child_pid == 0) { 
-        // The execute_child function includes child execution logic and handles errors
-        execute_child(num_args, cmd_args);
-        // If it returns, an error occurred, and the child process exits
-        exit(EXIT_FAILURE); // Ensure the child process exits even if execute_child returns unexpectedly
+void retain_program(struct program *prog) {
+    retained_programs = realloc(retained_programs, sizeof(struct program *) * (num_retained_programs + 1));
+    if (retained_programs == NULL) {
+        error_handling("Error - failed allocating the function table");
     }
-    
-    // Parent process handling
-    // No errors occurred in the parent, allowing the shell to handle another command
-    return 1; 
+    retained_programs[num_retained_programs++] = prog;
 }
 
-// External function to wait for a child process and handle errors
-int wait_and_handle_error(pid_t child_pid, const char *error_message) {
-    int status;
-    if (waitpid(child_pid, &status, 0) == -1 && errno != ECHILD && errno != EINTR) {
-        // Ignore ECHILD and EINTR in the parent shell after waitpid, as they are not considered errors
-        perror(error_message);
-        return 0; // An error occurred
+void clear_pending_input(void) {
+    for (int i = 0; i < pending.count; i++) {
+        free(pending.tokens[i]);
     }
+    pending.count = 0;
+    pending.depth = 0;
+}
 
-    return 1; // No error
+const char *program_token(const struct program *prog, int index) {
+    return prog->strings + prog->tokens[index];
 }
 
-// Helper function to set signal handling for child processes
-void set_child_signal_handling() {
-    if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
-        error_handling("Error - failed to update SIGINT signal handling for the child process");
-    }
-    if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
-        error_handling("Error - failed to update SIGCHLD signal handling for the child process");
+int emit_op(struct compiler *c, int opcode, int a, int b, int d) {
+    struct program *prog = c->prog;
+    if (prog->num_ops == c->ops_capacity) {
+        c->ops_capacity = c->ops_capacity ? 2 * c->ops_capacity : 64;
+        prog->ops = realloc(prog->ops, sizeof(struct op) * c->ops_capacity);
+        if (prog->ops == NULL) {
+            error_handling("Error - failed allocating the compiled program");
+        }
     }
+    prog->ops[prog->num_ops] = (struct op){ opcode, a, b, d };
+    return prog->num_ops++;
 }
 
-// Helper function to redirect stdout to a pipe
-void redirect_stdout_to_pipe(int pipefd_write) {
-    if (dup2(pipefd_write, STDOUT_FILENO) == -1) {
-        error_handling("Error - failed to redirect stdout to the pipe");
+// Point every jump in a chain linked through the ops' a fields at target
+void patch_chain(struct compiler *c, int chain, int target) {
+    while (chain != -1) {
+        int next = c->prog->ops[chain].a;
+        c->prog->ops[chain].a = target;
+        chain = next;
     }
-    close(pipefd_write);  // Close the pipe write end after redirection
 }
 
-// Helper function to redirect stdin from a pipe
-void redirect_stdin_from_pipe(int pipefd_read) {
-    if (dup2(pipefd_read, STDIN_FILENO) == -1) {
-        error_handling("Error - failed to redirect stdin from the pipe");
-    }
-    close(pipefd_read);  // Close the pipe read end after redirection
+int at_keyword(struct compiler *c, const char *keyword) {
+    return c->parser.pos < c->parser.num_tokens && strcmp(c->parser.tokens[c->parser.pos], keyword) == 0;
 }
 
-// Helper function to close both ends of a pipe
-void close_pipe_ends(int pipefd[2]) {
-    close(pipefd[0]);  // Close read end
-    close(pipefd[1]);  // Close write end
+void expect_keyword(struct compiler *c, const char *keyword) {
+    if (c->parser.error != NULL) {
+        return;
+    }
+    if (at_keyword(c, keyword)) {
+        c->parser.pos++;
+    } else {
+        c->parser.error = c->parser.pos < c->parser.num_tokens ? c->parser.tokens[c->parser.pos] : "end of file";
+    }
 }
 
+// Compile statements until one of the terminator keywords shows up at command position
+void compile_statements(struct compiler *c, const char *const *terminators) {
+    while (c->parser.error == NULL) {
+        while (at_keyword(c, ";")) {
+            c->parser.pos++;
+        }
+        if (c->parser.pos == c->parser.num_tokens) {
+            return;
+        }
+        for (int i = 0; terminators[i] != NULL; i++) {
+            if (at_keyword(c, terminators[i])) {
+                return;
+            }
+        }
+        compile_statement(c);
+    }
+}
 
-int establish_pipe(int index, char **cmd_args) {
-    // Execute commands with piping
+void compile_statement(struct compiler *c) {
+    const char *tok = c->parser.tokens[c->parser.pos];
+    size_t len = strlen(tok);
+    int compound = 1;
 
-    // Set up pipe
-    int pipefd[2];
-    cmd_args[index] = NULL;
+    // A closing keyword with nothing open, e.g. a stray 'fi'
+    static const char *const closers[] = { "then", "do", "else", "elif", "fi", "done", "}", NULL };
+    for (int i = 0; closers[i] != NULL; i++) {
+        if (strcmp(tok, closers[i]) == 0) {
+            c->parser.error = tok;
+            return;
+        }
+    }
 
-    if (pipe(pipefd) == -1) {
-        error_handling("Error - failed piping");
-        return 0;
+    if (strcmp(tok, "if") == 0) {
+        compile_if(c);
+    } else if (strcmp(tok, "while") == 0 || strcmp(tok, "until") == 0) {
+        compile_while(c);
+    } else if (strcmp(tok, "for") == 0) {
+        compile_for(c);
+    } else if (strcmp(tok, "function") == 0 || (len > 2 && strcmp(tok + len - 2, "()") == 0)) {
+        compile_function(c);
+    } else if (strcmp(tok, "local") == 0) {
+        compile_local(c);
+        compound = 0;
+    } else {
+        struct list_node *node = parse_and_or(&c->parser);
+        if (c->parser.error == NULL) {
+            compile_node(c, node);
+        }
+        compound = 0;
     }
 
-    // Create the first child
-    pid_t pid_first = fork();
-    if (pid_first == -1) {
-        // Fork failed
-        error_handling("Error - failed forking");
-        return 0;
+    // A compound command ends its statement, only a separator or a closing keyword may follow
+    if (compound && c->parser.error == NULL && c->parser.pos < c->parser.num_tokens && !at_keyword(c, ";") &&
+        !at_keyword(c, "fi") && !at_keyword(c, "done") && !at_keyword(c, "}") && !at_keyword(c, "else") &&
+        !at_keyword(c, "elif")) {
+        c->parser.error = c->parser.tokens[c->parser.pos];
     }
+}
 
-    if (pid_first == 0) {
-        // First child process
-        set_child_signal_handling();  // Set signal handling for the child
+// Lower a ';'/'&&'/'||' AST from the list parser into jumps around OP_EXEC
+void compile_node(struct compiler *c, struct list_node *node) {
+    int jump;
+    switch (node->type) {
+    case NODE_COMMAND: {
+        const char *first = c->parser.tokens[node->first];
+        if (strcmp(first, "break") == 0 || strcmp(first, "continue") == 0 || strcmp(first, "return") == 0) {
+            compile_control(c, node);
+            return;
+        }
+        int needs_expansion = 0;
+        for (int i = node->first; i < node->first + node->count; i++) {
+            needs_expansion |= word_needs_expansion(c->parser.tokens[i]);
+        }
+        emit_op(c, OP_EXEC, node->first, node->count, needs_expansion);
+        return;
+    }
+    case NODE_SEQUENCE:
+        compile_node(c, node->left);
+        compile_node(c, node->right);
+        return;
+    case NODE_AND:
+    case NODE_OR:
+        compile_node(c, node->left);
+        jump = emit_op(c, node->type == NODE_AND ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK, -1, 0, 0);
+        compile_node(c, node->right);
+        c->prog->ops[jump].a = c->prog->num_ops;
+        return;
+    }
+}
 
-        close(pipefd[0]);  // Close unused read end of the pipe
-        redirect_stdout_to_pipe(pipefd[1]);  // Redirect stdout to the pipe
+// break [n], continue [n] and return [status] become jumps resolved at compile time
+void compile_control(struct compiler *c, struct list_node *node) {
+    const char *keyword = c->parser.tokens[node->first];
+    if (node->count > 2) {
+        c->parser.error = c->parser.tokens[node->first + 2];
+        return;
+    }
 
-        // Execute the first command
-        if (execvp(cmd_args[0], cmd_args) == -1) {
-            error_handling("Error - failed execution of the first command");
+    if (strcmp(keyword, "return") == 0) {
+        if (c->function_depth == 0) {
+            fprintf(stderr, "myshell: return: can only be used in a function\n");
+            c->parser.error = "";
+            return;
         }
+        emit_op(c, OP_RETURN, node->count == 2 ? node->first + 1 : -1, 0, 0);
+        return;
     }
 
-    // Create the second child
-    pid_t pid_second = fork();
-    if (pid_second == -1) {
-        // Fork failed
-        error_handling("Error - failed forking");
-        return 0;
+    int levels = node->count == 2 ? atoi(c->parser.tokens[node->first + 1]) : 1;
+    if (c->loop_depth == 0 || levels < 1) {
+        fprintf(stderr, "myshell: %s: only meaningful in a loop\n", keyword);
+        c->parser.error = "";
+        return;
+    }
+    if (levels > c->loop_depth) {
+        levels = c->loop_depth;
     }
 
-    if (pid_second == 0) {
-        // Second child process
-        set_child_signal_handling();  // Set signal handling for the child
+    // Leaving a for-loop drops its loop record; continue keeps the target loop's own record
+    struct loop_context *target = &c->loops[c->loop_depth - levels];
+    int is_break = strcmp(keyword, "break") == 0;
+    int pops = 0;
+    for (int i = c->loop_depth - levels + (is_break ? 0 : 1); i < c->loop_depth; i++) {
+        pops += c->loops[i].is_for;
+    }
+    if (is_break) {
+        target->break_chain = emit_op(c, OP_UNWIND, target->break_chain, pops, 0);
+    } else {
+        emit_op(c, OP_UNWIND, target->continue_target, pops, 0);
+    }
+}
 
-        close(pipefd[1]);  // Close unused write end of the pipe
-        redirect_stdin_from_pipe(pipefd[0]);  // Redirect stdin from the pipe
+// if LIST then LIST [elif LIST then LIST]... [else LIST] fi
+void compile_if(struct compiler *c) {
+    static const char *const then_terms[] = { "then", NULL };
+    static const char *const body_terms[] = { "elif", "else", "fi", NULL };
+    static const char *const else_terms[] = { "fi", NULL };
+    int end_chain = -1;
 
-        // Execute the second command
-        if (execvp(cmd_args[index + 1], cmd_args + index + 1) == -1) {
-            error_handling("Error - execution of the command failed");
+    c->parser.pos++;
+    while (c->parser.error == NULL) {
+        compile_statements(c, then_terms);
+        expect_keyword(c, "then");
+        int next_branch = emit_op(c, OP_JUMP_IF_FAIL, -1, 0, 0);
+        compile_statements(c, body_terms);
+        if (at_keyword(c, "elif") || at_keyword(c, "else")) {
+            end_chain = emit_op(c, OP_JUMP, end_chain, 0, 0);
         }
+        c->prog->ops[next_branch].a = c->prog->num_ops;
+        if (at_keyword(c, "elif")) {
+            c->parser.pos++;
+            continue;
+        }
+        if (at_keyword(c, "else")) {
+            c->parser.pos++;
+            compile_statements(c, else_terms);
+        }
+        break;
     }
+    expect_keyword(c, "fi");
+    patch_chain(c, end_chain, c->prog->num_ops);
+}
 
-    // Parent process
-    close_pipe_ends(pipefd);  // Close both ends of the pipe
+// while|until LIST do LIST done
+void compile_while(struct compiler *c) {
+    static const char *const do_terms[] = { "do", NULL };
+    static const char *const done_terms[] = { "done", NULL };
+    int until = at_keyword(c, "until");
 
-    // Wait for the first child
-    if (!wait_and_handle_error(pid_first, "Error - waitpid failed for the first child")) {
-        return 0;
+    if (c->loop_depth == MAX_LOOP_DEPTH) {
+        c->parser.error = c->parser.tokens[c->parser.pos];
+        return;
     }
+    c->parser.pos++;
+    // The loop's status is that of the last body command, 0 when the body never ran. Each pass keeps it
+    // in the loop's slot before the condition overwrites it, and leaving through the condition loads it.
+    int slot = c->loop_depth;
+    emit_op(c, OP_KEEP_STATUS, slot, 0, 0);
+    int enter = emit_op(c, OP_JUMP, -1, 0, 0);
+    int again = emit_op(c, OP_KEEP_STATUS, slot, -1, 0);
+    c->prog->ops[enter].a = c->prog->num_ops;
+    compile_statements(c, do_terms);
+    expect_keyword(c, "do");
+    int exit_jump = emit_op(c, until ? OP_JUMP_IF_OK : OP_JUMP_IF_FAIL, -1, 0, 0);
 
-    // Wait for the second child
-    if (!wait_and_handle_error(pid_second, "Error - waitpid failed for the second child")) {
-        return 0;
-    }
+    struct loop_context *loop = &c->loops[c->loop_depth++];
+    loop->is_for = 0;
+    loop->continue_target = again;
+    loop->break_chain = -1;
+    compile_statements(c, done_terms);
+    expect_keyword(c, "done");
+    emit_op(c, OP_JUMP, again, 0, 0);
 
-    return 1; // No error in the parent, allowing the shell to handle another command
+    c->loop_depth--;
+    c->prog->ops[exit_jump].a = emit_op(c, OP_LOAD_STATUS, slot, 0, 0);
+    // break leaves with its own status, 0
+    patch_chain(c, loop->break_chain, c->prog->num_ops);
 }
 
-// Helper function to set signal handling for a child process
-void set_signal_handling_child() {
-    if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
-        error_handling("Error - unable to update SIGINT signal handling for the child process");
+// for NAME [in WORDS...] ; do LIST done
+void compile_for(struct compiler *c) {
+    static const char *const done_terms[] = { "done", NULL };
+
+    if (c->loop_depth == MAX_LOOP_DEPTH) {
+        c->parser.error = c->parser.tokens[c->parser.pos];
+        return;
     }
-    if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
-        error_handling("Error - unable to update SIGCHLD signal handling for the child process");
+    c->parser.pos++;
+    if (c->parser.pos == c->parser.num_tokens ||
+        !is_valid_name(c->parser.tokens[c->parser.pos], strlen(c->parser.tokens[c->parser.pos]))) {
+        c->parser.error = c->parser.pos < c->parser.num_tokens ? c->parser.tokens[c->parser.pos] : "end of file";
+        return;
     }
-}
+    int name = c->parser.pos++;
 
-// Helper function to handle the file opening and redirection logic
-int open_and_redirect_file(char *filename) {
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-    if (fd == -1) {
-        error_handling("Error - unable to open or create the specified file for redirection");
+    // Without 'in' the loop runs over the positional parameters
+    int first = -1, count = 0;
+    if (at_keyword(c, "in")) {
+        first = ++c->parser.pos;
+        while (c->parser.pos < c->parser.num_tokens && !at_keyword(c, ";") && !at_keyword(c, "do")) {
+            c->parser.pos++;
+        }
+        count = c->parser.pos - first;
     }
-    if (dup2(fd, 1) == -1) {
-        error_handling("Error - failed to redirect stdout to the specified file");
+    while (at_keyword(c, ";")) {
+        c->parser.pos++;
     }
-    close(fd);
-    return 1;
-}
+    expect_keyword(c, "do");
 
+    emit_op(c, OP_FOR_INIT, name, first, count);
+    int next = emit_op(c, OP_FOR_NEXT, -1, 0, 0);
+    struct loop_context *loop = &c->loops[c->loop_depth++];
+    loop->is_for = 1;
+    loop->continue_target = next;
+    loop->break_chain = -1;
+    compile_statements(c, done_terms);
+    expect_keyword(c, "done");
+    emit_op(c, OP_JUMP, next, 0, 0);
 
-// Function to set up output redirection
-int setup_output_redirection(int num_args, char **cmd_args) {
-    // Check if the command includes a single redirection symbol (">").
-    // If found, open the specified file that comes after the symbol
-    // and execute the child process, redirecting its standard output (stdout) to the file.
-    // Modify arglist to truncate it at the redirection symbol.
-    cmd_args[num_args - 2] = NULL;
-    // Fork to create a child process
-    pid_t pid = fork();
-    if (pid == -1) { // Fork failed
-        error_handling("Error - failed forking");
-        return 0; // Return 0 to indicate an error in the original process
-    } else if (pid == 0) { // Child process
-        // Set signal handling for the child process
-        set_signal_handling_child();
-        // Open and redirect the specified file
-        if (!open_and_redirect_file(cmd_args[num_args - 1])) {
-            exit(1); // Terminate child process on error
-        }
+    c->loop_depth--;
+    c->prog->ops[next].a = c->prog->num_ops;
+    patch_chain(c, loop->break_chain, c->prog->num_ops);
+}
 
-        // Execute the command in the child process.
-        if (execvp(cmd_args[0], cmd_args) == -1) {
-            error_handling("Error - execution of the command failed");
-        }
+// function NAME { LIST }  or  NAME() { LIST }
+void compile_function(struct compiler *c) {
+    static const char *const brace_terms[] = { "}", NULL };
+
+    if (at_keyword(c, "function")) {
+        c->parser.pos++;
     }
-        return 1;
+    if (c->parser.pos == c->parser.num_tokens) {
+        c->parser.error = "end of file";
+        return;
+    }
+    // Drop a trailing "()" in place, the compiler owns its copy of the tokens
+    int name = c->parser.pos++;
+    char *name_token = c->parser.tokens[name];
+    size_t len = strlen(name_token);
+    if (len > 2 && strcmp(name_token + len - 2, "()") == 0) {
+        name_token[len - 2] = '\0';
+        len -= 2;
     }
+    if (!is_valid_name(name_token, len)) {
+        c->parser.error = name_token;
+        return;
+    }
+    while (at_keyword(c, ";")) {
+        c->parser.pos++;
+    }
+    expect_keyword(c, "{");
+
+    emit_op(c, OP_DEFINE, name, c->prog->num_ops + 2, 0);
+    int skip = emit_op(c, OP_JUMP, -1, 0, 0);
+
+    // Loops do not reach across a function body
+    int saved_loop_depth = c->loop_depth;
+    c->loop_depth = 0;
+    c->function_depth++;
+    compile_statements(c, brace_terms);
+    expect_keyword(c, "}");
+    emit_op(c, OP_RETURN, -1, 0, 0);
+    c->function_depth--;
+    c->loop_depth = saved_loop_depth;
+
+    c->prog->ops[skip].a = c->prog->num_ops;
+    c->prog->defines_functions = 1;
+}
+
+// local NAME[=VALUE]...
+void compile_local(struct compiler *c) {
+    if (c->function_depth == 0) {
+        fprintf(stderr, "myshell: local: can only be used in a function\n");
+        c->parser.error = "";
+        return;
+    }
+    int first = ++c->parser.pos;
+    while (c->parser.pos < c->parser.num_tokens && !at_keyword(c, ";") &&
+           !is_list_operator(c->parser.tokens[c->parser.pos])) {
+        c->parser.pos++;
+    }
+    emit_op(c, OP_LOCAL, first, c->parser.pos - first, 0);
+}
+
+// Compile a token stream into a program, or report the syntax error and return NULL
+struct program *compile_program(char **tokens, int num_tokens) {
+    static const char *const no_terms[] = { NULL };
+    struct program *prog = calloc(1, sizeof(struct program));
+    if (prog == NULL) {
+        error_handling("Error - failed allocating the compiled program");
+    }
+
+    // Copy the tokens into the program's string block, the parser works on pointers into that copy
+    for (int i = 0; i < num_tokens; i++) {
+        prog->strings_len += strlen(tokens[i]) + 1;
+    }
+    prog->strings = malloc(prog->strings_len ? prog->strings_len : 1);
+    prog->tokens = malloc(sizeof(uint32_t) * (num_tokens + 1));
+    char **views = malloc(sizeof(char *) * (num_tokens + 1));
+    struct list_node *nodes = malloc(sizeof(struct list_node) * (2 * num_tokens + 1));
+    if (prog->strings == NULL || prog->tokens == NULL || views == NULL || nodes == NULL) {
+        error_handling("Error - failed allocating the compiled program");
+    }
+    uint32_t offset = 0;
+    for (int i = 0; i < num_tokens; i++) {
+        size_t len = strlen(tokens[i]) + 1;
+        memcpy(prog->strings + offset, tokens[i], len);
+        prog->tokens[i] = offset;
+        views[i] = prog->strings + offset;
+        offset += len;
+    }
+    prog->num_tokens = num_tokens;
+
+    struct compiler c;
+    memset(&c, 0, sizeof(c));
+    c.parser = (struct list_parser){ views, num_tokens, 0, nodes, 0, NULL };
+    c.prog = prog;
+    compile_statements(&c, no_terms);
+    if (c.parser.error == NULL && c.parser.pos < num_tokens) {
+        c.parser.error = views[c.parser.pos];
+    }
+    emit_op(&c, OP_HALT, 0, 0, 0);
+
+    if (c.parser.error != NULL) {
+        // An empty error token means the message was already printed
+        if (c.parser.error[0] != '\0') {
+            fprintf(stderr, "myshell: syntax error near '%s'\n", c.parser.error);
+        }
+        free(views);
+        free(nodes);
+        free_program(prog);
+        return NULL;
+    }
+    free(views);
+    free(nodes);
+    return prog;
+}
+
+void free_program(struct program *prog) {
+    if (prog == NULL) {
+        return;
+    }
+    if (prog->mapping != NULL) {
+        munmap(prog->mapping, prog->mapping_len);
+    } else {
+        free(prog->ops);
+        free(prog->tokens);
+        free(prog->strings);
+    }
+    free(prog);
+}
+
+// Command line of the shell itself:
+//   myshell                                  read commands from stdin
+//   myshell -c-compile script.msh [-o out]   compile a script to out (default script.mshc)
+//   myshell -c-instance WORDS...             run one instance of a supervised job, as spawn_instance execs it
+//   myshell script                           run a precompiled script, or a plain one line by line
+int process_options(int argc, char **argv) {
+    if (argc < 2) {
+        return -1;
+    }
+    // A script runs like a non-interactive shell, its foreground commands stay in the shell's process group
+    job_control = 0;
+    if (strcmp(argv[1], "-c-instance") == 0) {
+        if (argc > 2) {
+            process_arglist(argc - 2, argv + 2);
+        }
+        fflush(stdout);
+        return last_status;
+    }
+    if (strcmp(argv[1], "-c-compile") == 0) {
+        if (argc != 3 && !(argc == 5 && strcmp(argv[3], "-o") == 0)) {
+            fprintf(stderr, "usage: myshell -c-compile script.msh [-o script.mshc]\n");
+            return 2;
+        }
+        if (argc == 5) {
+            return compile_script(argv[2], argv[4]);
+        }
+        // script.msh -> script.mshc, anything else gets the suffix appended
+        size_t len = strlen(argv[2]);
+        char *output = malloc(len + sizeof(".mshc"));
+        if (output == NULL) {
+            error_handling("Error - failed allocating the output name");
+        }
+        strcpy(output, argv[2]);
+        if (len > 4 && strcmp(output + len - 4, ".msh") == 0) {
+            output[len - 4] = '\0';
+        }
+        strcat(output, ".mshc");
+        int status = compile_script(argv[2], output);
+        free(output);
+        return status;
+    }
+
+    struct program *prog = load_program(argv[1]);
+    if (prog != NULL) {
+        vm_run(prog, 0);
+        // Kept until finalize, its function bodies may still be referenced
+        retain_program(prog);
+        return last_status;
+    }
+    if (errno != ENOEXEC) {
+        return 127;
+    }
+    // Not compiled: feed the file to the line reader in place of stdin
+    if (freopen(argv[1], "r", stdin) == NULL) {
+        fprintf(stderr, "myshell: %s: %s\n", argv[1], strerror(errno));
+        return 127;
+    }
+    return -1;
+}
+
+// Tokenize a script the way the line reader does, compile it as one program and write it out
+int compile_script(const char *source, const char *output) {
+    FILE *in = fopen(source, "r");
+    if (in == NULL) {
+        fprintf(stderr, "myshell: %s: %s\n", source, strerror(errno));
+        return 1;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    char **args = NULL;
+    int capacity = 0;
+    while (getline(&line, &size, in) != -1) {
+        int count = 0;
+        for (char *token = strtok(line, " \t\n"); token != NULL; token = strtok(NULL, " \t\n")) {
+            if (count + 1 >= capacity) {
+                capacity = capacity ? 2 * capacity : 16;
+                args = realloc(args, sizeof(char *) * capacity);
+                if (args == NULL) {
+                    error_handling("Error - failed allocating the script line");
+                }
+            }
+            args[count++] = token;
+        }
+        char **joined;
+        int num_joined = join_substitutions(count, args, &joined);
+        if (joined != NULL) {
+            queue_pending_line(num_joined, joined, 0);
+            free_joined(num_joined, joined);
+        } else if (count > 0) {
+            queue_pending_line(count, args, 0);
+        }
+    }
+    free(line);
+    free(args);
+    fclose(in);
+
+    struct program *prog = compile_program(pending.tokens, pending.count);
+    clear_pending_input();
+    if (prog == NULL) {
+        return 2;
+    }
+    int status = write_program(prog, output);
+    free_program(prog);
+    return status;
+}
+
+// Write the program beside the target and rename it into place, so a running reader never maps half a file
+int write_program(const struct program *prog, const char *output) {
+    struct mshc_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MSHC_MAGIC, sizeof(header.magic));
+    header.version = MSHC_VERSION;
+    header.byte_order = MSHC_BYTE_ORDER;
+    header.num_ops = prog->num_ops;
+    header.num_tokens = prog->num_tokens;
+    header.strings_len = prog->strings_len;
+    header.ops_offset = sizeof(header);
+    header.tokens_offset = header.ops_offset + sizeof(struct op) * prog->num_ops;
+    header.strings_offset = header.tokens_offset + sizeof(uint32_t) * prog->num_tokens;
+
+    size_t len = strlen(output);
+    char *temp = malloc(len + sizeof(".tmp"));
+    if (temp == NULL) {
+        error_handling("Error - failed allocating the output name");
+    }
+    memcpy(temp, output, len);
+    memcpy(temp + len, ".tmp", sizeof(".tmp"));
+
+    FILE *out = fopen(temp, "w");
+    if (out == NULL) {
+        fprintf(stderr, "myshell: %s: %s\n", temp, strerror(errno));
+        free(temp);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(prog->ops, sizeof(struct op), prog->num_ops, out);
+    fwrite(prog->tokens, sizeof(uint32_t), prog->num_tokens, out);
+    fwrite(prog->strings, 1, prog->strings_len, out);
+    if (ferror(out) | fclose(out) || rename(temp, output) == -1) {
+        fprintf(stderr, "myshell: %s: %s\n", output, strerror(errno));
+        unlink(temp);
+        free(temp);
+        return 1;
+    }
+    free(temp);
+    return 0;
+}
+
+// Map a precompiled script and point a program at it. NULL with errno ENOEXEC when the file is not one.
+struct program *load_program(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    struct mshc_header header;
+    if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, MSHC_MAGIC, sizeof(header.magic)) != 0) {
+        close(fd);
+        errno = ENOEXEC;
+        return NULL;
+    }
+    if (header.version != MSHC_VERSION || header.byte_order != MSHC_BYTE_ORDER) {
+        fprintf(stderr, "myshell: %s: compiled by an incompatible shell, compile it again\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    // Private and writable: the VM briefly splits assignment words in place, which copies only that page
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct program *prog = calloc(1, sizeof(struct program));
+    if (prog == NULL) {
+        error_handling("Error - failed allocating the compiled program");
+    }
+    prog->mapping = base;
+    prog->mapping_len = st.st_size;
+
+    uint64_t size = st.st_size;
+    if ((uint64_t)header.ops_offset + (uint64_t)sizeof(struct op) * header.num_ops > size ||
+        (uint64_t)header.tokens_offset + (uint64_t)sizeof(uint32_t) * header.num_tokens > size ||
+        (uint64_t)header.strings_offset + header.strings_len > size ||
+        header.ops_offset % sizeof(uint32_t) != 0 || header.tokens_offset % sizeof(uint32_t) != 0 ||
+        header.num_ops > INT32_MAX || header.num_tokens > INT32_MAX) {
+        fprintf(stderr, "myshell: %s: truncated compiled script\n", path);
+        free_program(prog);
+        return NULL;
+    }
+    prog->ops = (struct op *)((char *)base + header.ops_offset);
+    prog->num_ops = header.num_ops;
+    prog->tokens = (uint32_t *)((char *)base + header.tokens_offset);
+    prog->num_tokens = header.num_tokens;
+    prog->strings = (char *)base + header.strings_offset;
+    prog->strings_len = header.strings_len;
+    if (!validate_program(prog)) {
+        fprintf(stderr, "myshell: %s: corrupt compiled script\n", path);
+        free_program(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+// One pass over the ops checking every jump and token range, then one over the control flow checking the
+// loop nesting, so the VM can trust a mapped program
+int validate_program(const struct program *prog) {
+    int ops = prog->num_ops;
+    int tokens = prog->num_tokens;
+    if (ops == 0 || prog->ops[ops - 1].opcode != OP_HALT ||
+        (prog->strings_len > 0 && prog->strings[prog->strings_len - 1] != '\0')) {
+        return 0;
+    }
+    for (int i = 0; i < tokens; i++) {
+        if (prog->tokens[i] >= prog->strings_len) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < ops; i++) {
+        const struct op *op = &prog->ops[i];
+        int valid;
+        switch (op->opcode) {
+        case OP_EXEC:
+        case OP_LOCAL:
+            valid = op->a >= 0 && op->b >= 0 && op->a <= tokens - op->b;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FAIL:
+        case OP_JUMP_IF_OK:
+        case OP_FOR_NEXT:
+            valid = op->a >= 0 && op->a < ops;
+            break;
+        case OP_FOR_INIT:
+            valid = op->a >= 0 && op->a < tokens &&
+                    (op->b == -1 || (op->b >= 0 && op->c >= 0 && op->b <= tokens - op->c));
+            break;
+        case OP_UNWIND:
+            valid = op->a >= 0 && op->a < ops && op->b >= 0 && op->b <= MAX_LOOP_DEPTH;
+            break;
+        case OP_DEFINE:
+            valid = op->a >= 0 && op->a < tokens && op->b >= 0 && op->b < ops;
+            break;
+        case OP_RETURN:
+            valid = op->a >= -1 && op->a < tokens;
+            break;
+        case OP_KEEP_STATUS:
+        case OP_LOAD_STATUS:
+            valid = op->a >= 0 && op->a < MAX_LOOP_DEPTH;
+            break;
+        case OP_HALT:
+            valid = 1;
+            break;
+        default:
+            valid = 0;
+        }
+        if (!valid) {
+            return 0;
+        }
+    }
+    return validate_loop_depth(prog);
+}
+
+// Every op must be reached with one for-loop depth, the one the compiler gave it: within MAX_LOOP_DEPTH, at
+// least 1 at OP_FOR_NEXT and at least b at OP_UNWIND. The program starts at depth 0, as every function body does.
+int validate_loop_depth(const struct program *prog) {
+    int ops = prog->num_ops;
+    int *depth_at = malloc(sizeof(int) * ops);
+    int *pending = malloc(sizeof(int) * ops);
+    int num_pending = 0;
+    int valid = depth_at != NULL && pending != NULL;
+    for (int i = 0; valid && i < ops; i++) {
+        depth_at[i] = -1;
+    }
+    valid = valid && reach_op(depth_at, pending, &num_pending, 0, 0);
+    while (valid && num_pending > 0) {
+        int pc = pending[--num_pending];
+        int depth = depth_at[pc];
+        const struct op *op = &prog->ops[pc];
+        // Every op but the last has a next one: the last is OP_HALT
+        switch (op->opcode) {
+        case OP_EXEC:
+        case OP_LOCAL:
+        case OP_KEEP_STATUS:
+        case OP_LOAD_STATUS:
+            valid = reach_op(depth_at, pending, &num_pending, pc + 1, depth);
+            break;
+        case OP_DEFINE:
+            valid = reach_op(depth_at, pending, &num_pending, pc + 1, depth) &&
+                    reach_op(depth_at, pending, &num_pending, op->b, 0);
+            break;
+        case OP_JUMP:
+            valid = reach_op(depth_at, pending, &num_pending, op->a, depth);
+            break;
+        case OP_JUMP_IF_FAIL:
+        case OP_JUMP_IF_OK:
+            valid = reach_op(depth_at, pending, &num_pending, pc + 1, depth) &&
+                    reach_op(depth_at, pending, &num_pending, op->a, depth);
+            break;
+        case OP_FOR_INIT:
+            valid = reach_op(depth_at, pending, &num_pending, pc + 1, depth + 1);
+            break;
+        case OP_FOR_NEXT:
+            valid = reach_op(depth_at, pending, &num_pending, pc + 1, depth) &&
+                    reach_op(depth_at, pending, &num_pending, op->a, depth - 1);
+            break;
+        case OP_UNWIND:
+            valid = reach_op(depth_at, pending, &num_pending, op->a, depth - op->b);
+            break;
+        }
+    }
+    free(depth_at);
+    free(pending);
+    return valid;
+}
+
+// Reach op pc with a loop depth: the first time it is queued to be followed, later it must agree
+int reach_op(int *depth_at, int *pending, int *num_pending, int pc, int depth) {
+    if (depth < 0 || depth > MAX_LOOP_DEPTH || (depth_at[pc] != -1 && depth_at[pc] != depth)) {
+        return 0;
+    }
+    if (depth_at[pc] == -1) {
+        depth_at[pc] = depth;
+        pending[(*num_pending)++] = pc;
+    }
+    return 1;
+}
+
+// The dispatch loop: runs from pc until the program halts or a function returns
+int vm_run(const struct program *prog, int pc) {
+    struct loop_record loops[MAX_LOOP_DEPTH];
+    int kept_status[MAX_LOOP_DEPTH] = { 0 };
+    int depth = 0;
+    int result = 1;
+    struct word_list words;
+
+    while (result) {
+        const struct op *op = &prog->ops[pc++];
+        switch (op->opcode) {
+        case OP_EXEC:
+            result = vm_exec(prog, op);
+            break;
+        case OP_JUMP:
+            pc = op->a;
+            break;
+        case OP_JUMP_IF_FAIL:
+            if (last_status != 0) {
+                pc = op->a;
+            }
+            break;
+        case OP_JUMP_IF_OK:
+            if (last_status == 0) {
+                pc = op->a;
+            }
+            break;
+        case OP_FOR_INIT:
+            memset(&words, 0, sizeof(words));
+            if (op->b == -1) {
+                // Loop over the positional parameters of the running function
+                for (int i = 1; call_depth > 0 && i < frames[call_depth - 1].argc; i++) {
+                    append_word(&words, strdup(frames[call_depth - 1].argv[i]));
+                }
+            } else {
+                char **tokens = malloc(sizeof(char *) * (op->c + 1));
+                for (int i = 0; i < op->c; i++) {
+                    tokens[i] = (char *)program_token(prog, op->b + i);
+                }
+                expand_words(tokens, op->c, &words);
+                free(tokens);
+            }
+            loops[depth++] = (struct loop_record){ words.words, words.count, 0, program_token(prog, op->a) };
+            // A loop whose body never runs has status 0, otherwise that of the body's last command
+            last_status = 0;
+            break;
+        case OP_FOR_NEXT: {
+            struct loop_record *loop = &loops[depth - 1];
+            if (loop->index < loop->count) {
+                set_var(loop->name, loop->words[loop->index++]);
+            } else {
+                words = (struct word_list){ loop->words, loop->count, loop->count };
+                free_word_list(&words);
+                depth--;
+                pc = op->a;
+            }
+            break;
+        }
+        case OP_UNWIND:
+            // break and continue are commands of their own, with status 0
+            last_status = 0;
+            for (int i = 0; i < op->b; i++) {
+                depth--;
+                words = (struct word_list){ loops[depth].words, loops[depth].count, loops[depth].count };
+                free_word_list(&words);
+            }
+            pc = op->a;
+            break;
+        case OP_DEFINE:
+            define_function(program_token(prog, op->a), prog, op->b);
+            last_status = 0;
+            break;
+        case OP_LOCAL: {
+            char **tokens = malloc(sizeof(char *) * (op->b + 1));
+            for (int i = 0; i < op->b; i++) {
+                tokens[i] = (char *)program_token(prog, op->a + i);
+            }
+            memset(&words, 0, sizeof(words));
+            expand_words(tokens, op->b, &words);
+            free(tokens);
+            for (int i = 0; i < words.count; i++) {
+                char *eq = strchr(words.words[i], '=');
+                if (eq != NULL) {
+                    *eq = '\0';
+                }
+                declare_local(words.words[i], eq != NULL ? eq + 1 : "");
+            }
+            free_word_list(&words);
+            last_status = 0;
+            break;
+        }
+        case OP_RETURN:
+            if (op->a != -1) {
+                char *token = (char *)program_token(prog, op->a);
+                memset(&words, 0, sizeof(words));
+                expand_words(&token, 1, &words);
+                last_status = words.count > 0 ? atoi(words.words[0]) & 0xff : 0;
+                free_word_list(&words);
+            }
+            goto done;
+        case OP_KEEP_STATUS:
+            kept_status[op->a] = op->b == -1 ? last_status : op->b;
+            break;
+        case OP_LOAD_STATUS:
+            last_status = kept_status[op->a];
+            break;
+        case OP_HALT:
+            goto done;
+        }
+    }
+
+done:
+    while (depth > 0) {
+        depth--;
+        words = (struct word_list){ loops[depth].words, loops[depth].count, loops[depth].count };
+        free_word_list(&words);
+    }
+    return result;
+}
+
+// Run one pipeline list leaf: expand it, then assign, call a function, or hand it to the plan cache
+int vm_exec(const struct program *prog, const struct op *op) {
+    struct word_list words = { NULL, 0, 0 };
+    char **argv = malloc(sizeof(char *) * (op->b + 1));
+    int result = 1;
+    if (argv == NULL) {
+        error_handling("Error - failed allocating the command");
+    }
+    for (int i = 0; i < op->b; i++) {
+        argv[i] = (char *)program_token(prog, op->a + i);
+    }
+    argv[op->b] = NULL;
+    int argc = op->b;
+
+    // Words without '$' go to the plan cache as they are, a loop body repeats the same line every time
+    if (op->c) {
+        expand_words(argv, argc, &words);
+        free(argv);
+        argc = words.count;
+        argv = words.words;
+    }
+
+    int assignments = 0;
+    while (assignments < argc && is_assignment(argv[assignments])) {
+        assignments++;
+    }
+    int simple = 1;
+    for (int i = 0; i < argc; i++) {
+        if (is_pipeline_operator(argv[i])) {
+            simple = 0;
+        }
+    }
+
+    struct function *fn;
+    if (argc == 0) {
+        last_status = 0;
+    } else if (assignments == argc) {
+        for (int i = 0; i < argc; i++) {
+            char *eq = strchr(argv[i], '=');
+            *eq = '\0';
+            set_var(argv[i], eq + 1);
+            *eq = '=';
+        }
+        last_status = 0;
+    } else {
+        // NAME=VALUE words before a command are exported to that command only
+        int mark = num_saved_vars;
+        for (int i = 0; i < assignments; i++) {
+            char *eq = strchr(argv[i], '=');
+            *eq = '\0';
+            struct shell_var *var = find_var(argv[i], 1);
+            save_var(var, -1);
+            var->exported = 1;
+            set_var(argv[i], eq + 1);
+            *eq = '=';
+        }
+        if (simple && (fn = find_function(argv[assignments])) != NULL) {
+            result = call_function(fn, argc - assignments, argv + assignments);
+        } else {
+            struct plan *plan = lookup_plan(argc - assignments, argv + assignments);
+            if (plan == NULL) {
+                last_status = 2;
+            } else {
+                result = run_plan(plan);
+            }
+        }
+        restore_vars(mark);
+    }
+
+    if (op->c) {
+        free_word_list(&words);
+        // The command has its copies of the substitution pipes, or has finished with them
+        close_process_substitutions();
+    } else {
+        free(argv);
+    }
+    return result;
+}
+
+struct function *find_function(const char *name) {
+    for (int i = 0; i < num_functions; i++) {
+        if (strcmp(functions[i].name, name) == 0) {
+            return &functions[i];
+        }
+    }
+    return NULL;
+}
+
+void define_function(const char *name, const struct program *prog, int entry) {
+    struct function *fn = find_function(name);
+    if (fn == NULL) {
+        functions = realloc(functions, sizeof(struct function) * (num_functions + 1));
+        if (functions == NULL) {
+            error_handling("Error - failed allocating a function");
+        }
+        fn = &functions[num_functions++];
+        fn->name = strdup(name);
+    }
+    fn->prog = prog;
+    fn->entry = entry;
+}
+
+// Run a function body with its own positional parameters and locals
+int call_function(struct function *fn, int argc, char **argv) {
+    if (call_depth == MAX_CALL_DEPTH) {
+        fprintf(stderr, "myshell: %s: maximum function nesting exceeded\n", fn->name);
+        last_status = 1;
+        return 1;
+    }
+    frames[call_depth++] = (struct frame){ argc, argv };
+    last_status = 0;
+    int result = vm_run(fn->prog, fn->entry);
+    pop_locals(call_depth);
+    call_depth--;
+    return result;
+}
+
+void append_word(struct word_list *list, char *word) {
+    if (list->count + 1 >= list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 8;
+        list->words = realloc(list->words, sizeof(char *) * list->capacity);
+        if (list->words == NULL) {
+            error_handling("Error - failed allocating the expanded words");
+        }
+    }
+    list->words[list->count++] = word;
+    list->words[list->count] = NULL;
+}
+
+void free_word_list(struct word_list *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->words[i]);
+    }
+    free(list->words);
+    list->words = NULL;
+    list->count = list->capacity = 0;
+}
+
+// Expand $NAME, ${NAME}, $N, $#, $?, $@, $*, $(...) and `...` in every token; a word that expands to nothing is dropped
+int expand_words(char **tokens, int count, struct word_list *out) {
+    for (int i = 0; i < count; i++) {
+        expand_word(tokens[i], out);
+    }
+    return out->count;
+}
+
+void expand_word(const char *token, struct word_list *out) {
+    struct frame *frame = call_depth > 0 ? &frames[call_depth - 1] : NULL;
+
+    // "$@" on its own is one word per positional parameter
+    if (strcmp(token, "$@") == 0) {
+        for (int i = 1; frame != NULL && i < frame->argc; i++) {
+            append_word(out, strdup(frame->argv[i]));
+        }
+        return;
+    }
+
+    // <(...) and >(...) become the path of a pipe to a command running alongside
+    const char *end = process_substitution_end(token);
+    if (end != NULL && end[1] == '\0') {
+        append_word(out, process_substitution(token + 2, end - token - 2, token[0] == '<'));
+        return;
+    }
+
+    // A substitution that is the whole word becomes one word per whitespace separated field of its output
+    end = substitution_end(token);
+    if (end != NULL && end[1] == '\0') {
+        const char *inner = token + (token[0] == '$' ? 2 : 1);
+        char *output = command_substitution(inner, end - inner);
+        char **fields;
+        int count = split_words(output, &fields);
+        for (int i = 0; i < count; i++) {
+            append_word(out, strdup(fields[i]));
+        }
+        free(fields);
+        free(output);
+        return;
+    }
+
+    size_t len = 0, capacity = strlen(token) + 1;
+    char *word = malloc(capacity);
+    int expanded = 0;
+    char number[16];
+    if (word == NULL) {
+        error_handling("Error - failed allocating an expanded word");
+    }
+
+    for (const char *p = token; *p != '\0'; ) {
+        const char *value = NULL;
+        char *joined = NULL;
+        const char *end = substitution_end(p);
+        if (end == NULL && (*p != '$' || p[1] == '\0')) {
+            if (len + 2 > capacity) {
+                capacity *= 2;
+                word = realloc(word, capacity);
+                if (word == NULL) {
+                    error_handling("Error - failed allocating an expanded word");
+                }
+            }
+            word[len++] = *p++;
+            continue;
+        }
+
+        expanded = 1;
+        if (end != NULL) {
+            // Inside a larger word the output is kept as it is, less its trailing newlines
+            const char *inner = p + (*p == '$' ? 2 : 1);
+            joined = command_substitution(inner, end - inner);
+            value = joined;
+            p = end + 1;
+        } else if (*++p == '?') {
+            snprintf(number, sizeof(number), "%d", last_status);
+            value = number;
+            p++;
+        } else if (*p == '#') {
+            snprintf(number, sizeof(number), "%d", frame != NULL ? frame->argc - 1 : 0);
+            value = number;
+            p++;
+        } else if (*p >= '0' && *p <= '9') {
+            int index = *p++ - '0';
+            value = index == 0 ? "myshell" : (frame != NULL && index < frame->argc ? frame->argv[index] : "");
+        } else if (*p == '@' || *p == '*') {
+            // Inside a larger word the parameters are joined with spaces
+            size_t total = 1;
+            for (int i = 1; frame != NULL && i < frame->argc; i++) {
+                total += strlen(frame->argv[i]) + 1;
+            }
+            joined = calloc(1, total);
+            for (int i = 1; frame != NULL && i < frame->argc; i++) {
+                if (i > 1) {
+                    strcat(joined, " ");
+                }
+                strcat(joined, frame->argv[i]);
+            }
+            value = joined;
+            p++;
+        } else if (*p == '{' && strchr(p, '}') != NULL && is_valid_name(p + 1, strchr(p, '}') - p - 1)) {
+            const char *close = strchr(p, '}');
+            char *name = strndup(p + 1, close - p - 1);
+            value = get_var(name);
+            free(name);
+            p = close + 1;
+        } else {
+            size_t name_len = 0;
+            while (p[name_len] == '_' || (p[name_len] >= 'a' && p[name_len] <= 'z') ||
+                   (p[name_len] >= 'A' && p[name_len] <= 'Z') || (name_len > 0 && p[name_len] >= '0' && p[name_len] <= '9')) {
+                name_len++;
+            }
+            if (name_len == 0) {
+                // A '$' that starts no expansion is kept as it is
+                value = "$";
+            } else {
+                char *name = strndup(p, name_len);
+                value = get_var(name);
+                free(name);
+                p += name_len;
+            }
+        }
+
+        size_t value_len = value != NULL ? strlen(value) : 0;
+        if (len + value_len + 1 > capacity) {
+            capacity = 2 * (len + value_len + 1);
+            word = realloc(word, capacity);
+        }
+        if (word == NULL) {
+            error_handling("Error - failed allocating an expanded word");
+        }
+        memcpy(word + len, value != NULL ? value : "", value_len);
+        len += value_len;
+        free(joined);
+    }
+    word[len] = '\0';
+
+    if (expanded && len == 0) {
+        free(word);
+        return;
+    }
+    // A pattern that matches nothing stays as it is written, assignments are never globbed
+    if (!is_assignment(word) && has_glob_chars(word) && glob_word(word, out) > 0) {
+        free(word);
+        return;
+    }
+    append_word(out, word);
+}
+
+// Join the tokens of each $(...), `...`, <(...) or >(...) back into one word, with single spaces as the line reader lost
+// the original ones. joined is set to a new token list, or to NULL when the line needs no joining.
+int join_substitutions(int num_args, char **cmd_args, char ***joined) {
+    *joined = NULL;
+    int needed = 0;
+    for (int i = 0; i < num_args && !needed; i++) {
+        needed = strstr(cmd_args[i], "$(") != NULL || strchr(cmd_args[i], '`') != NULL ||
+                 strncmp(cmd_args[i], "<(", 2) == 0 || strncmp(cmd_args[i], ">(", 2) == 0;
+    }
+    if (!needed) {
+        return num_args;
+    }
+
+    char **out = malloc(sizeof(char *) * (num_args + 1));
+    if (out == NULL) {
+        error_handling("Error - failed allocating the command");
+    }
+    int count = 0, depth = 0, in_backquote = 0;
+    for (int i = 0; i < num_args; i++) {
+        if (depth > 0 || in_backquote) {
+            // Still inside a substitution opened by an earlier token
+            char *word = out[count - 1];
+            size_t len = strlen(word);
+            word = realloc(word, len + strlen(cmd_args[i]) + 2);
+            if (word == NULL) {
+                error_handling("Error - failed allocating the command");
+            }
+            word[len] = ' ';
+            strcpy(word + len + 1, cmd_args[i]);
+            out[count - 1] = word;
+        } else {
+            out[count++] = strdup(cmd_args[i]);
+        }
+        for (const char *p = cmd_args[i]; *p != '\0'; p++) {
+            if ((*p == '$' || *p == '<' || *p == '>') && p[1] == '(') {
+                depth++;
+                p++;
+            } else if (*p == '(' && depth > 0) {
+                depth++;
+            } else if (*p == ')' && depth > 0) {
+                depth--;
+            } else if (*p == '`') {
+                in_backquote = !in_backquote;
+            }
+        }
+    }
+    out[count] = NULL;
+    if (count == num_args) {
+        free_joined(count, out);
+        return num_args;
+    }
+    *joined = out;
+    return count;
+}
+
+void free_joined(int num_args, char **joined) {
+    for (int i = 0; i < num_args; i++) {
+        free(joined[i]);
+    }
+    free(joined);
+}
+
+// The closing ')' or '`' of a substitution starting at p, or NULL when p starts none or it is unterminated
+const char *substitution_end(const char *p) {
+    if (*p == '`') {
+        return strchr(p + 1, '`');
+    }
+    return p[0] == '$' && p[1] == '(' ? matching_paren(p + 1) : NULL;
+}
+
+// The same for <(...) and >(...)
+const char *process_substitution_end(const char *p) {
+    return (p[0] == '<' || p[0] == '>') && p[1] == '(' ? matching_paren(p + 1) : NULL;
+}
+
+// The ')' closing the '(' at p, counting the ones nested inside
+const char *matching_paren(const char *p) {
+    int depth = 1;
+    for (p++; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Start a command on one end of a pipe and return the /dev/fd path of the other end for the command being
+// expanded. The shell's end is O_CLOEXEC, only the child that runs that command clears the flag, so no
+// other command ever inherits it. reading is set for <(...), where the command reads what this one writes.
+char *process_substitution(const char *text, size_t len, int reading) {
+    int pipefd[2];
+    if (num_process_substitutions == MAX_PROCESS_SUBSTITUTIONS) {
+        fprintf(stderr, "myshell: too many process substitutions\n");
+        return strdup("/dev/null");
+    }
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        error_handling("Error - failed to create the substitution pipe");
+        return strdup("/dev/null");
+    }
+    int keep = reading ? pipefd[0] : pipefd[1];
+    int give = reading ? pipefd[1] : pipefd[0];
+
+    char *line = strndup(text, len);
+    char **args;
+    if (line == NULL) {
+        error_handling("Error - failed allocating a process substitution");
+    }
+    int count = split_words(line, &args);
+
+    // It runs alongside the command and is reaped like a background child
+    fflush(stdout);
+    get_envp();
+    pid_t pid = fork_own_child(-1, 0);
+    if (pid == -1) {
+        error_handling("Error - failed to create the substitution process");
+    } else if (pid == 0) {
+        is_child_process = 1;
+        job_control = 0;
+        cgroup_unavailable = 1;
+        close(keep);
+        if (reading) {
+            redirect_stdout_to_pipe(give);
+        } else {
+            redirect_stdin_from_pipe(give);
+        }
+        // The other substitutions of the line belong to the command, not to this one
+        for (int i = 0; i < num_process_substitutions; i++) {
+            close(process_substitution_fds[i]);
+        }
+        num_process_substitutions = 0;
+        if (count > 0) {
+            process_arglist(count, args);
+        }
+        fflush(stdout);
+        _exit(last_status);
+    } else {
+        track_background_child(pid);
+    }
+    close(give);
+    free(args);
+    free(line);
+
+    process_substitution_fds[num_process_substitutions++] = keep;
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", keep);
+    return strdup(path);
+}
+
+void close_process_substitutions(void) {
+    for (int i = 0; i < num_process_substitutions; i++) {
+        close(process_substitution_fds[i]);
+    }
+    num_process_substitutions = 0;
+}
+
+// Run a command line and return what it wrote to stdout, less trailing newlines; the status becomes $?.
+// A lone builtin writes into a memory stream in the shell, anything else runs in a child behind a pipe.
+char *command_substitution(const char *text, size_t len) {
+    char *line = strndup(text, len);
+    char **args;
+    if (line == NULL) {
+        error_handling("Error - failed allocating a command substitution");
+    }
+    int count = split_words(line, &args);
+    char *output = NULL;
+    size_t size = 0;
+
+    int plain = count > 0;
+    for (int i = 0; i < count && plain; i++) {
+        plain = !word_needs_expansion(args[i]) && !is_list_operator(args[i]) && !is_pipeline_operator(args[i]);
+    }
+    int needs_compiler = 0;
+    if (plain) {
+        scan_control_flow(count, args, &needs_compiler);
+    }
+    builtin_fn builtin = plain && !needs_compiler ? find_builtin(args[0]) : NULL;
+
+    if (count == 0) {
+        last_status = 0;
+    } else if (builtin != NULL) {
+        FILE *out = open_memstream(&output, &size);
+        if (out == NULL) {
+            error_handling("Error - failed allocating a command substitution");
+        }
+        last_status = builtin(count, args, out);
+        fclose(out);
+    } else {
+        // A plain external command is planned here so the child only has to exec it
+        struct plan *plan = plain && !needs_compiler ? lookup_plan(count, args) : NULL;
+        if (plan != NULL && (plan->num_stages != 1 || plan->background)) {
+            plan = NULL;
+        }
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == -1) {
+            error_handling("Error - failed to create the substitution pipe");
+            free(args);
+            free(line);
+            return strdup("");
+        }
+        fflush(stdout);
+        get_envp();
+        pid_t pid = fork_own_child(-1, 0);
+        if (pid == -1) {
+            error_handling("Error - failed to create the substitution process");
+        } else if (pid == 0) {
+            is_child_process = 1;
+            job_control = 0;
+            cgroup_unavailable = 1;
+            if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
+                error_handling("Failed to adjust SIGINT handling in the child process");
+            }
+            close(pipefd[0]);
+            redirect_stdout_to_pipe(pipefd[1]);
+            if (plan != NULL) {
+                execute_child(&plan->stages[0]);
+            }
+            process_arglist(count, args);
+            fflush(stdout);
+            _exit(last_status);
+        }
+        close(pipefd[1]);
+
+        size_t capacity = 4096;
+        output = malloc(capacity);
+        ssize_t nread;
+        while (output != NULL && (nread = read(pipefd[0], output + size, capacity - size - 1)) != 0) {
+            if (nread == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            size += nread;
+            if (capacity - size < 2) {
+                capacity *= 2;
+                output = realloc(output, capacity);
+            }
+        }
+        if (output == NULL) {
+            error_handling("Error - failed allocating a command substitution");
+        }
+        output[size] = '\0';
+        close(pipefd[0]);
+        if (pid != -1) {
+            wait_and_handle_error(pid, "Failed to wait for the command substitution");
+        }
+    }
+    if (output == NULL) {
+        output = strdup("");
+    }
+    while (size > 0 && output[size - 1] == '\n') {
+        output[--size] = '\0';
+    }
+    free(args);
+    free(line);
+    return output;
+}
+
+// Split text in place at blanks and newlines; words is set to the NULL terminated list of fields
+int split_words(char *text, char ***words) {
+    int count = 0, capacity = 8;
+    *words = malloc(sizeof(char *) * capacity);
+    if (*words == NULL) {
+        error_handling("Error - failed allocating the words");
+    }
+    for (char *field = strtok(text, " \t\n"); field != NULL; field = strtok(NULL, " \t\n")) {
+        if (count + 1 == capacity) {
+            capacity *= 2;
+            *words = realloc(*words, sizeof(char *) * capacity);
+            if (*words == NULL) {
+                error_handling("Error - failed allocating the words");
+            }
+        }
+        (*words)[count++] = field;
+    }
+    (*words)[count] = NULL;
+    return count;
+}
+
+// Words the VM must rewrite before running them: variables, substitutions and glob patterns
+int word_needs_expansion(const char *token) {
+    return strchr(token, '$') != NULL || strchr(token, '`') != NULL || has_glob_chars(token) ||
+           ((token[0] == '<' || token[0] == '>') && token[1] == '(');
+}
+
+// '*', '?' or a bracket expression that is closed; a lone '[' is the test builtin
+int has_glob_chars(const char *word) {
+    for (const char *p = word; *p != '\0'; p++) {
+        if (*p == '*' || *p == '?' || (*p == '[' && p[1] != '\0' && strchr(p + 2, ']') != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Expand a pattern against the filesystem, appending the sorted matches. Returns how many there were.
+int glob_word(const char *pattern, struct word_list *out) {
+    struct word_list matches = { NULL, 0, 0 };
+    char *copy = strdup(pattern);
+    char **components = malloc(sizeof(char *) * (strlen(pattern) + 2));
+    if (copy == NULL || components == NULL) {
+        error_handling("Error - failed allocating a glob pattern");
+    }
+
+    // A trailing '/' matches directories only, and '**' at the end means every path below
+    size_t len = strlen(copy);
+    int dirs_only = len > 0 && copy[len - 1] == '/';
+    int num_components = 0;
+    for (char *part = strtok(copy, "/"); part != NULL; part = strtok(NULL, "/")) {
+        components[num_components++] = part;
+    }
+    if (num_components > 0 && strcmp(components[num_components - 1], "**") == 0) {
+        components[num_components++] = "*";
+    }
+
+    int absolute = pattern[0] == '/';
+    int dirfd = open(absolute ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd != -1 && num_components > 0) {
+        glob_dir(dirfd, absolute ? "/" : "", components, num_components, 0, dirs_only, &matches);
+    }
+    if (dirfd != -1) {
+        close(dirfd);
+    }
+
+    qsort(matches.words, matches.count, sizeof(char *), compare_words);
+    for (int i = 0; i < matches.count; i++) {
+        append_word(out, matches.words[i]);
+    }
+    int count = matches.count;
+    free(matches.words);
+    free(components);
+    free(copy);
+    return count;
+}
+
+// Match components[idx..] inside dirfd, whose path as it is printed is prefix ("" or ending in '/')
+void glob_dir(int dirfd, const char *prefix, char **components, int num_components, int idx, int dirs_only,
+              struct word_list *matches) {
+    const char *component = components[idx];
+    int last = idx == num_components - 1;
+    size_t prefix_len = strlen(prefix);
+
+    // A literal component is looked up directly, without reading the directory
+    if (!has_glob_chars(component)) {
+        struct stat st;
+        if (last) {
+            if (fstatat(dirfd, component, &st, dirs_only ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+                (!dirs_only || S_ISDIR(st.st_mode))) {
+                glob_emit(prefix, component, dirs_only, matches);
+            }
+            return;
+        }
+        int fd = openat(dirfd, component, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            char *path = malloc(prefix_len + strlen(component) + 2);
+            sprintf(path, "%s%s/", prefix, component);
+            glob_dir(fd, path, components, num_components, idx + 1, dirs_only, matches);
+            free(path);
+            close(fd);
+        }
+        return;
+    }
+
+    struct dir_listing *listing = read_dir(dirfd);
+    if (listing == NULL) {
+        return;
+    }
+    int globstar = strcmp(component, "**") == 0;
+    if (globstar && !in_glob_walker) {
+        release_dir(listing);
+        glob_walk_parallel(dirfd, prefix, components, num_components, idx + 1, dirs_only, matches);
+        return;
+    }
+    if (globstar) {
+        // Zero directories, then every directory below; symlinks are not followed, so there are no cycles
+        glob_dir(dirfd, prefix, components, num_components, idx + 1, dirs_only, matches);
+    }
+    for (int i = 0; i < listing->count; i++) {
+        const char *name = listing->names[i];
+        if (name[0] == '.' && (globstar || component[0] != '.')) {
+            continue;
+        }
+        if (!globstar && !glob_match(component, name)) {
+            continue;
+        }
+        if (last && !globstar) {
+            if (!dirs_only || glob_is_dir(dirfd, listing, i, 1)) {
+                glob_emit(prefix, name, dirs_only, matches);
+            }
+            continue;
+        }
+        if (!glob_is_dir(dirfd, listing, i, !globstar)) {
+            continue;
+        }
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        char *path = malloc(prefix_len + strlen(name) + 2);
+        sprintf(path, "%s%s/", prefix, name);
+        glob_dir(fd, path, components, num_components, globstar ? idx : idx + 1, dirs_only, matches);
+        free(path);
+        close(fd);
+    }
+    release_dir(listing);
+}
+
+void glob_emit(const char *prefix, const char *name, int dirs_only, struct word_list *matches) {
+    char *path = malloc(strlen(prefix) + strlen(name) + 2);
+    if (path == NULL) {
+        error_handling("Error - failed allocating a glob match");
+    }
+    sprintf(path, "%s%s%s", prefix, name, dirs_only ? "/" : "");
+    append_word(matches, path);
+}
+
+// Shell pattern match of one path component: '*', '?', and [set], [a-z], [!set]
+int glob_match(const char *pattern, const char *name) {
+    const char *star = NULL, *resume = NULL;
+    while (*name != '\0') {
+        if (*pattern == '*') {
+            // Remember the star, on a mismatch it absorbs one more character and matching retries
+            star = ++pattern;
+            resume = name;
+            continue;
+        }
+        int matched = 0;
+        const char *next = pattern + 1;
+        if (*pattern == '?') {
+            matched = 1;
+        } else if (*pattern == '[' && strchr(pattern + 2, ']') != NULL) {
+            const char *p = pattern + 1;
+            int negate = *p == '!' || *p == '^';
+            if (negate) {
+                p++;
+            }
+            int in_set = 0;
+            // A ']' right after the '[' is a member, not the end of the set
+            do {
+                if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+                    in_set |= (unsigned char)*name >= (unsigned char)p[0] &&
+                              (unsigned char)*name <= (unsigned char)p[2];
+                    p += 3;
+                } else {
+                    in_set |= *name == *p;
+                    p++;
+                }
+            } while (*p != ']' && *p != '\0');
+            matched = in_set != negate;
+            next = *p == ']' ? p + 1 : p;
+        } else {
+            matched = *pattern == *name;
+        }
+        if (matched && *pattern != '\0') {
+            pattern = next;
+            name++;
+        } else if (star != NULL) {
+            pattern = star;
+            name = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+// '**' over a whole tree: directories are walked by a few threads, each matching the rest of the pattern
+// in the directories it reads. The threads live only for this walk, so no fork ever sees them.
+void glob_walk_parallel(int dirfd, const char *prefix, char **components, int num_components, int idx,
+                        int dirs_only, struct word_list *matches) {
+    struct glob_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.components = components;
+    walk.num_components = num_components;
+    walk.idx = idx;
+    walk.dirs_only = dirs_only;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.num_threads = cpus < 1 ? 1 : cpus > MAX_GLOB_THREADS ? MAX_GLOB_THREADS : (int)cpus;
+    for (int i = 0; i < walk.num_threads; i++) {
+        pthread_mutex_init(&walk.queues[i].lock, NULL);
+    }
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.idle_wake, NULL);
+
+    int fd = dup(dirfd);
+    char *start = strdup(prefix);
+    if (fd == -1 || start == NULL) {
+        error_handling("Error - failed starting the directory walk");
+    }
+    walk_push(&walk, 0, fd, start);
+
+    // Signals stay with the shell's own thread, the walkers start with everything blocked
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    pthread_t threads[MAX_GLOB_THREADS];
+    struct walk_worker workers[MAX_GLOB_THREADS];
+    int started = 1;
+    for (int i = 1; i < walk.num_threads; i++) {
+        workers[i] = (struct walk_worker){ &walk, i };
+        if (pthread_create(&threads[i], NULL, glob_walker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    // The calling thread is walker 0, so the walk finishes even when no thread could be started
+    workers[0] = (struct walk_worker){ &walk, 0 };
+    glob_walker(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Merged in any order, glob_word sorts the combined matches
+    for (int i = 0; i < walk.num_threads; i++) {
+        for (int j = 0; j < walk.matches[i].count; j++) {
+            append_word(matches, walk.matches[i].words[j]);
+        }
+        free(walk.matches[i].words);
+        free(walk.queues[i].items);
+        pthread_mutex_destroy(&walk.queues[i].lock);
+    }
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.idle_wake);
+}
+
+void *glob_walker(void *arg) {
+    struct walk_worker *worker = arg;
+    struct glob_walk *walk = worker->walk;
+    int saved = in_glob_walker;
+    in_glob_walker = 1;
+    while (atomic_load(&walk->pending) > 0) {
+        // Read before looking, so an item queued while this thread searches is not slept through
+        unsigned int seen = atomic_load(&walk->queued);
+        struct walk_item item;
+        int found = walk_take(&walk->queues[worker->id], &item, 0);
+        for (int i = 1; !found && i < walk->num_threads; i++) {
+            found = walk_take(&walk->queues[(worker->id + i) % walk->num_threads], &item, 1);
+        }
+        if (!found) {
+            // Everything left is being walked by other threads, which may still queue more
+            pthread_mutex_lock(&walk->idle_lock);
+            while (atomic_load(&walk->queued) == seen && atomic_load(&walk->pending) > 0) {
+                pthread_cond_wait(&walk->idle_wake, &walk->idle_lock);
+            }
+            pthread_mutex_unlock(&walk->idle_lock);
+            continue;
+        }
+        glob_walk_dir(walk, worker->id, &item);
+        if (atomic_fetch_sub(&walk->pending, 1) == 1) {
+            walk_wake(walk, 1);
+        }
+    }
+    in_glob_walker = saved;
+    return NULL;
+}
+
+// Match the rest of the pattern in one directory, and queue its subdirectories
+void glob_walk_dir(struct glob_walk *walk, int id, struct walk_item *item) {
+    if (walk->idx < walk->num_components) {
+        glob_dir(item->fd, item->prefix, walk->components, walk->num_components, walk->idx, walk->dirs_only,
+                 &walk->matches[id]);
+    }
+    struct dir_listing *listing = read_dir(item->fd);
+    size_t prefix_len = strlen(item->prefix);
+    for (int i = 0; listing != NULL && i < listing->count; i++) {
+        const char *name = listing->names[i];
+        // Hidden directories are skipped and symlinks are not followed, so there are no cycles
+        if (name[0] == '.' || !glob_is_dir(item->fd, listing, i, 0)) {
+            continue;
+        }
+        int fd = openat(item->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd == -1) {
+            continue;
+        }
+        char *path = malloc(prefix_len + strlen(name) + 2);
+        if (path == NULL) {
+            error_handling("Error - failed allocating a glob match");
+        }
+        sprintf(path, "%s%s/", item->prefix, name);
+        walk_push(walk, id, fd, path);
+    }
+    if (listing != NULL) {
+        release_dir(listing);
+    }
+    close(item->fd);
+    free(item->prefix);
+}
+
+void walk_push(struct glob_walk *walk, int id, int fd, char *prefix) {
+    struct walk_queue *queue = &walk->queues[id];
+    // Counted before it is visible, so no thread sees the walk finished while this item waits
+    atomic_fetch_add(&walk->pending, 1);
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity) {
+        // Slide the live items down over the stolen ones before growing
+        if (queue->head > 0) {
+            memmove(queue->items, queue->items + queue->head, sizeof(struct walk_item) * (queue->tail - queue->head));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        if (queue->tail * 2 >= queue->capacity) {
+            queue->capacity = queue->capacity ? 2 * queue->capacity : 64;
+            queue->items = realloc(queue->items, sizeof(struct walk_item) * queue->capacity);
+            if (queue->items == NULL) {
+                error_handling("Error - failed allocating the walk queue");
+            }
+        }
+    }
+    queue->items[queue->tail++] = (struct walk_item){ fd, prefix };
+    pthread_mutex_unlock(&queue->lock);
+    walk_wake(walk, 0);
+}
+
+// Tell idle walkers there is something to steal, or with all set that the walk is over
+void walk_wake(struct glob_walk *walk, int all) {
+    pthread_mutex_lock(&walk->idle_lock);
+    atomic_fetch_add(&walk->queued, 1);
+    if (all) {
+        pthread_cond_broadcast(&walk->idle_wake);
+    } else {
+        pthread_cond_signal(&walk->idle_wake);
+    }
+    pthread_mutex_unlock(&walk->idle_lock);
+}
+
+// The owner takes the newest item, depth first and warm in its cache; a thief takes the oldest,
+// which is nearest the root and likely the biggest subtree
+int walk_take(struct walk_queue *queue, struct walk_item *item, int steal) {
+    pthread_mutex_lock(&queue->lock);
+    int found = queue->head < queue->tail;
+    if (found) {
+        *item = steal ? queue->items[queue->head++] : queue->items[--queue->tail];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// Directory test from d_type, with a stat only when the filesystem left it unknown or it is a symlink to follow
+int glob_is_dir(int dirfd, const struct dir_listing *listing, int i, int follow) {
+    unsigned char type = listing->types[i];
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type != DT_UNKNOWN && !(type == DT_LNK && follow)) {
+        return 0;
+    }
+    struct stat st;
+    return fstatat(dirfd, listing->names[i], &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+// The listing of an open directory, from the cache when its dev, inode and mtime still match.
+// It comes back pinned, the caller hands it to release_dir when done iterating.
+struct dir_listing *read_dir(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+    pthread_mutex_lock(&glob_cache_lock);
+    for (int i = 0; i < GLOB_CACHE_SIZE; i++) {
+        struct dir_listing *entry = glob_cache[i];
+        if (entry != NULL && entry->dev == st.st_dev && entry->ino == st.st_ino &&
+            entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            entry->pins++;
+            entry->last_used = ++glob_cache_clock;
+            pthread_mutex_unlock(&glob_cache_lock);
+            return entry;
+        }
+    }
+    pthread_mutex_unlock(&glob_cache_lock);
+
+    struct dir_listing *listing = calloc(1, sizeof(struct dir_listing));
+    if (listing == NULL) {
+        error_handling("Error - failed allocating a directory listing");
+    }
+    size_t block_len = 0, block_capacity = 4096;
+    int capacity = 64;
+    listing->block = malloc(block_capacity);
+    size_t *offsets = malloc(sizeof(size_t) * capacity);
+    listing->types = malloc(capacity);
+    if (listing->block == NULL || offsets == NULL || listing->types == NULL) {
+        error_handling("Error - failed allocating a directory listing");
+    }
+
+    // The same directory can be listed twice in one walk, '**' matches zero directories too
+    lseek(fd, 0, SEEK_SET);
+    char buf[32768];
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long pos = 0; pos < nread; ) {
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *)(buf + pos);
+            pos += dirent->d_reclen;
+            const char *name = dirent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            size_t len = strlen(name) + 1;
+            if (block_len + len > block_capacity) {
+                block_capacity = 2 * (block_len + len);
+                listing->block = realloc(listing->block, block_capacity);
+            }
+            if (listing->count == capacity) {
+                capacity *= 2;
+                offsets = realloc(offsets, sizeof(size_t) * capacity);
+                listing->types = realloc(listing->types, capacity);
+            }
+            if (listing->block == NULL || offsets == NULL || listing->types == NULL) {
+                error_handling("Error - failed allocating a directory listing");
+            }
+            memcpy(listing->block + block_len, name, len);
+            offsets[listing->count] = block_len;
+            listing->types[listing->count++] = dirent->d_type;
+            block_len += len;
+        }
+    }
+    listing->names = malloc(sizeof(char *) * (listing->count + 1));
+    if (listing->names == NULL) {
+        error_handling("Error - failed allocating a directory listing");
+    }
+    for (int i = 0; i < listing->count; i++) {
+        listing->names[i] = listing->block + offsets[i];
+    }
+    free(offsets);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->pins = 1;
+
+    // mtime has timer-tick granularity, a directory changed within the last second could change again
+    // without its mtime moving, so such a listing is used once and not cached
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (nread != 0 || st.st_mtim.tv_sec >= now.tv_sec - 1) {
+        return listing;
+    }
+    // Replace the least recently used listing no walk is iterating, if there is one
+    pthread_mutex_lock(&glob_cache_lock);
+    int victim = -1;
+    for (int i = 0; i < GLOB_CACHE_SIZE; i++) {
+        struct dir_listing *entry = glob_cache[i];
+        if (entry == NULL) {
+            victim = i;
+            break;
+        }
+        if (entry->pins == 0 && (victim == -1 || entry->last_used < glob_cache[victim]->last_used)) {
+            victim = i;
+        }
+    }
+    if (victim != -1) {
+        free_dir_listing(glob_cache[victim]);
+        glob_cache[victim] = listing;
+        listing->cached = 1;
+        listing->last_used = ++glob_cache_clock;
+    }
+    pthread_mutex_unlock(&glob_cache_lock);
+    return listing;
+}
+
+void release_dir(struct dir_listing *listing) {
+    pthread_mutex_lock(&glob_cache_lock);
+    int unused = --listing->pins == 0 && !listing->cached;
+    pthread_mutex_unlock(&glob_cache_lock);
+    if (unused) {
+        free_dir_listing(listing);
+    }
+}
+
+void free_dir_listing(struct dir_listing *listing) {
+    if (listing == NULL) {
+        return;
+    }
+    free(listing->block);
+    free(listing->names);
+    free(listing->types);
+    free(listing);
+}
+
+int compare_words(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int is_valid_name(const char *name, size_t len) {
+    if (len == 0 || (name[0] >= '0' && name[0] <= '9')) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char ch = name[i];
+        if (!(ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// NAME=VALUE with a valid name
+int is_assignment(const char *token) {
+    const char *eq = strchr(token, '=');
+    return eq != NULL && is_valid_name(token, eq - token);
+}
+
+uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261U;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 16777619U;
+    }
+    return hash;
+}
+
+// Linear probing over a power of two table. A name keeps its slot once inserted, unset only clears the value,
+// so there are no tombstones and a probe stops at the first empty slot.
+struct shell_var *find_var(const char *name, int create) {
+    if (shell_vars_capacity == 0) {
+        import_environment();
+    }
+    if (create && 4 * (shell_vars_used + 1) > 3 * shell_vars_capacity) {
+        grow_vars();
+    }
+    uint32_t hash = hash_name(name);
+    size_t mask = shell_vars_capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct shell_var *var = &shell_vars[i];
+        if (var->name == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            var->name = strdup(name);
+            if (var->name == NULL) {
+                error_handling("Error - failed allocating a shell variable");
+            }
+            var->hash = hash;
+            shell_vars_used++;
+            return var;
+        }
+        if (var->hash == hash && strcmp(var->name, name) == 0) {
+            return var;
+        }
+    }
+}
+
+void grow_vars(void) {
+    struct shell_var *old = shell_vars;
+    size_t old_capacity = shell_vars_capacity;
+    shell_vars_capacity = old_capacity ? 2 * old_capacity : 64;
+    shell_vars = calloc(shell_vars_capacity, sizeof(struct shell_var));
+    if (shell_vars == NULL) {
+        error_handling("Error - failed allocating the variable table");
+    }
+    size_t mask = shell_vars_capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].name != NULL) {
+            size_t j = old[i].hash & mask;
+            while (shell_vars[j].name != NULL) {
+                j = (j + 1) & mask;
+            }
+            shell_vars[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Bookkeeping after a variable changed: the exec environment and cached PATH lookups may be stale
+void var_changed(const struct shell_var *var, int was_exported) {
+    if (var->exported || was_exported) {
+        envp_dirty = 1;
+    }
+    if (strcmp(var->name, "PATH") == 0) {
+        plan_cache_stale = 1;
+    }
+}
+
+// Variables start out as the environment the shell was given, every entry exported. Done on first use,
+// so code driving process_arglist without prepare sees the environment too.
+void import_environment(void) {
+    grow_vars();
+    for (char **env = environ; *env != NULL; env++) {
+        char *eq = strchr(*env, '=');
+        if (eq == NULL || !is_valid_name(*env, eq - *env)) {
+            continue;
+        }
+        char *name = strndup(*env, eq - *env);
+        struct shell_var *var = find_var(name, 1);
+        free(name);
+        free(var->value);
+        var->value = strdup(eq + 1);
+        var->exported = 1;
+    }
+    envp_dirty = 1;
+}
+
+// NAME=VALUE of every exported variable, rebuilt only after one of them changed
+char **get_envp(void) {
+    if (shell_vars_capacity == 0) {
+        import_environment();
+    }
+    if (!envp_dirty) {
+        return shell_envp;
+    }
+    for (int i = 0; shell_envp != NULL && shell_envp[i] != NULL; i++) {
+        free(shell_envp[i]);
+    }
+    free(shell_envp);
+
+    int count = 0;
+    for (size_t i = 0; i < shell_vars_capacity; i++) {
+        count += shell_vars[i].exported && shell_vars[i].value != NULL;
+    }
+    shell_envp = malloc(sizeof(char *) * (count + 1));
+    if (shell_envp == NULL) {
+        error_handling("Error - failed allocating the environment");
+    }
+    count = 0;
+    for (size_t i = 0; i < shell_vars_capacity; i++) {
+        struct shell_var *var = &shell_vars[i];
+        if (var->exported && var->value != NULL) {
+            size_t name_len = strlen(var->name), value_len = strlen(var->value);
+            char *entry = malloc(name_len + value_len + 2);
+            if (entry == NULL) {
+                error_handling("Error - failed allocating the environment");
+            }
+            memcpy(entry, var->name, name_len);
+            entry[name_len] = '=';
+            memcpy(entry + name_len + 1, var->value, value_len + 1);
+            shell_envp[count++] = entry;
+        }
+    }
+    shell_envp[count] = NULL;
+    // getenv in the shell and in builtins run by children sees the same variables as exec'd commands
+    environ = shell_envp;
+    envp_dirty = 0;
+    return shell_envp;
+}
+
+const char *get_var(const char *name) {
+    struct shell_var *var = find_var(name, 0);
+    return var != NULL ? var->value : NULL;
+}
+
+// Assign to the innermost binding, which is global unless a running function declared it local
+void set_var(const char *name, const char *value) {
+    struct shell_var *var = find_var(name, 1);
+    char *copy = strdup(value);
+    if (copy == NULL) {
+        error_handling("Error - failed allocating a shell variable");
+    }
+    free(var->value);
+    var->value = copy;
+    var_changed(var, var->exported);
+}
+
+void unset_var(const char *name) {
+    struct shell_var *var = find_var(name, 0);
+    if (var == NULL || var->value == NULL) {
+        return;
+    }
+    int was_exported = var->exported;
+    free(var->value);
+    var->value = NULL;
+    var->exported = 0;
+    var_changed(var, was_exported);
+}
+
+// Remember a variable's current binding on the save stack, to be put back by restore_vars
+void save_var(struct shell_var *var, int depth) {
+    if (num_saved_vars == saved_vars_capacity) {
+        saved_vars_capacity = saved_vars_capacity ? 2 * saved_vars_capacity : 32;
+        saved_vars = realloc(saved_vars, sizeof(struct saved_var) * saved_vars_capacity);
+        if (saved_vars == NULL) {
+            error_handling("Error - failed allocating a shell variable");
+        }
+    }
+    saved_vars[num_saved_vars++] = (struct saved_var){ var->name, var->value, var->depth, var->exported, depth };
+    var->value = NULL;
+}
+
+// Put back saved bindings down to mark; the slot is found again by name since the table may have grown
+void restore_vars(int mark) {
+    while (num_saved_vars > mark) {
+        struct saved_var *saved = &saved_vars[--num_saved_vars];
+        struct shell_var *var = find_var(saved->name, 0);
+        int was_exported = var->exported;
+        free(var->value);
+        var->value = saved->value;
+        var->depth = saved->depth;
+        var->exported = saved->exported;
+        var_changed(var, was_exported);
+    }
+}
+
+// A local shadows the caller's binding until the function returns, and stays exported if that one was
+void declare_local(const char *name, const char *value) {
+    struct shell_var *var = find_var(name, 1);
+    if (var->depth != call_depth) {
+        save_var(var, call_depth);
+        var->depth = call_depth;
+    }
+    set_var(name, value);
+}
+
+// Drop the locals of a returning function
+void pop_locals(int depth) {
+    int mark = num_saved_vars;
+    while (mark > 0 && saved_vars[mark - 1].owner_depth == depth) {
+        mark--;
+    }
+    restore_vars(mark);
+}
+
+int builtin_true(int argc, char **argv, FILE *out) {
+    (void)argc; (void)argv; (void)out;
+    return 0;
+}
+
+int builtin_false(int argc, char **argv, FILE *out) {
+    (void)argc; (void)argv; (void)out;
+    return 1;
+}
+
+// echo [-neE] [ARG...] - in the shell, it is the command scripts run most
+int builtin_echo(int argc, char **argv, FILE *out) {
+    int newline = 1, escapes = 0, i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0' &&
+           strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1); i++) {
+        for (const char *flag = argv[i] + 1; *flag != '\0'; flag++) {
+            if (*flag == 'n') {
+                newline = 0;
+            } else {
+                escapes = *flag == 'e';
+            }
+        }
+    }
+    for (int first = i; i < argc; i++) {
+        if (i > first) {
+            fputc(' ', out);
+        }
+        if (!escapes) {
+            fputs(argv[i], out);
+        } else if (!echo_escapes(argv[i], out)) {
+            return 0;   // '\c' ends the output, without the newline
+        }
+    }
+    if (newline) {
+        fputc('\n', out);
+    }
+    return 0;
+}
+
+// Write an argument of echo -e, returns 0 once a '\c' says to stop
+int echo_escapes(const char *arg, FILE *out) {
+    static const char simple[] = "\\\\a\ab\be\033E\033f\fn\nr\rt\tv\v";
+    for (const char *p = arg; *p != '\0'; p++) {
+        if (*p != '\\' || p[1] == '\0') {
+            fputc(*p, out);
+            continue;
+        }
+        p++;
+        const char *entry = NULL;
+        for (int i = 0; simple[i] != '\0'; i += 2) {
+            if (simple[i] == *p) {
+                entry = &simple[i];
+                break;
+            }
+        }
+        if (*p == 'c') {
+            return 0;
+        } else if (entry != NULL) {
+            fputc(entry[1], out);
+        } else if (*p == '0' || *p == 'x') {
+            // \0nnn octal or \xHH hex, up to three or two digits
+            int base = *p == '0' ? 8 : 16, max_digits = base == 8 ? 3 : 2, value = 0, digits = 0;
+            while (digits < max_digits && p[1] != '\0' &&
+                   strchr(base == 8 ? "01234567" : "0123456789abcdefABCDEF", p[1]) != NULL) {
+                char ch = *++p;
+                value = value * base + (ch <= '9' ? ch - '0' : (ch | 0x20) - 'a' + 10);
+                digits++;
+            }
+            if (base == 16 && digits == 0) {
+                fputs("\\x", out);
+            } else {
+                fputc(value, out);
+            }
+        } else {
+            fputc('\\', out);
+            fputc(*p, out);
+        }
+    }
+    return 1;
+}
+
+int builtin_pwd(int argc, char **argv, FILE *out) {
+    (void)argc; (void)argv;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("myshell: pwd");
+        return 1;
+    }
+    fprintf(out, "%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+// test EXPR / [ EXPR ] - the loop conditions scripts use most, without a fork per iteration
+int builtin_test(int argc, char **argv, FILE *out) {
+    (void)out;
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "myshell: [: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    return test_expression(argc - 1, argv + 1);
+}
+
+int test_expression(int argc, char **argv) {
+    if (argc == 0) {
+        return 1;
+    }
+    if (strcmp(argv[0], "!") == 0) {
+        int status = test_expression(argc - 1, argv + 1);
+        return status == 2 ? 2 : !status;
+    }
+    if (argc == 1) {
+        return argv[0][0] == '\0';
+    }
+    if (argc == 2) {
+        const char *op = argv[0], *arg = argv[1];
+        struct stat st;
+        if (strcmp(op, "-n") == 0) return arg[0] == '\0';
+        if (strcmp(op, "-z") == 0) return arg[0] != '\0';
+        if (strcmp(op, "-e") == 0) return stat(arg, &st) != 0;
+        if (strcmp(op, "-f") == 0) return stat(arg, &st) != 0 || !S_ISREG(st.st_mode);
+        if (strcmp(op, "-d") == 0) return stat(arg, &st) != 0 || !S_ISDIR(st.st_mode);
+        if (strcmp(op, "-s") == 0) return stat(arg, &st) != 0 || st.st_size == 0;
+        if (strcmp(op, "-r") == 0) return access(arg, R_OK) != 0;
+        if (strcmp(op, "-w") == 0) return access(arg, W_OK) != 0;
+        if (strcmp(op, "-x") == 0) return access(arg, X_OK) != 0;
+    }
+    if (argc == 3) {
+        const char *lhs = argv[0], *op = argv[1], *rhs = argv[2];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(lhs, rhs) != 0;
+        if (strcmp(op, "!=") == 0) return strcmp(lhs, rhs) == 0;
+        long a = atol(lhs), b = atol(rhs);
+        if (strcmp(op, "-eq") == 0) return !(a == b);
+        if (strcmp(op, "-ne") == 0) return !(a != b);
+        if (strcmp(op, "-lt") == 0) return !(a < b);
+        if (strcmp(op, "-le") == 0) return !(a <= b);
+        if (strcmp(op, "-gt") == 0) return !(a > b);
+        if (strcmp(op, "-ge") == 0) return !(a >= b);
+    }
+    fprintf(stderr, "myshell: test: unsupported expression\n");
+    return 2;
+}
+
+
+int finalize(void) {
+    if (pending.count > 0) {
+        fprintf(stderr, "myshell: syntax error: unexpected end of file\n");
+        clear_pending_input();
+    }
+    for (int i = 0; i < num_retained_programs; i++) {
+        free_program(retained_programs[i]);
+    }
+    free(retained_programs);
+    flush_plan_cache();
+    remove_cgroup_session();
+    for (int i = 0; i < GLOB_CACHE_SIZE; i++) {
+        free_dir_listing(glob_cache[i]);
+        glob_cache[i] = NULL;
+    }
+    return 0;
+}
+
+// External error handling function
+void error_handling(const char *message) {
+    perror(message);
+    if (is_child_process) {
+        _exit(EXIT_FAILURE);
+    }
+    exit(EXIT_FAILURE);
+}
+
+// FNV-1a over the tokens and their separators, i.e. over the normalized raw line
+uint64_t hash_arglist(int num_args, char **cmd_args) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < num_args; i++) {
+        for (const unsigned char *c = (const unsigned char *)cmd_args[i]; ; c++) {
+            hash = (hash ^ *c) * 1099511628211ULL;
+            if (*c == '\0') {
+                break;
+            }
+        }
+    }
+    return hash;
+}
+
+// Find the plan for a line in the cache, or build it and cache it in place of the least recently used one
+struct plan *lookup_plan(int num_args, char **cmd_args) {
+    if (plan_cache_stale) {
+        flush_plan_cache();
+    }
+    uint64_t hash = hash_arglist(num_args, cmd_args);
+    int victim = 0;
+
+    for (int i = 0; i < PLAN_CACHE_SIZE; i++) {
+        struct plan_cache_entry *entry = &plan_cache[i];
+        if (entry->plan != NULL && entry->hash == hash) {
+            // Confirm the hit against the stored tokens, a hash collision must not run another command
+            size_t offset = 0;
+            int match = 1;
+            for (int j = 0; j < num_args && match; j++) {
+                size_t len = strlen(cmd_args[j]) + 1;
+                match = offset + len <= entry->plan->arena_len &&
+                        memcmp(entry->plan->arena + offset, cmd_args[j], len) == 0;
+                offset += len;
+            }
+            if (match && offset == entry->plan->arena_len) {
+                entry->last_used = ++plan_cache_clock;
+                plan_cache_hits++;
+                return entry->plan;
+            }
+        }
+        if (entry->last_used < plan_cache[victim].last_used) {
+            victim = i;
+        }
+    }
+
+    plan_cache_misses++;
+    struct plan *plan = build_plan(num_args, cmd_args);
+    if (plan == NULL) {
+        return NULL;
+    }
+    free_plan(plan_cache[victim].plan);
+    plan_cache[victim].hash = hash;
+    plan_cache[victim].plan = plan;
+    plan_cache[victim].last_used = ++plan_cache_clock;
+    return plan;
+}
+
+void flush_plan_cache(void) {
+    for (int i = 0; i < PLAN_CACHE_SIZE; i++) {
+        free_plan(plan_cache[i].plan);
+        plan_cache[i].plan = NULL;
+        plan_cache[i].last_used = 0;
+    }
+    plan_cache_stale = 0;
+}
+
+// Look a command up on PATH once, when its plan is built, so repeated lines do not search again in the child
+char *resolve_executable(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return strdup(name);
+    }
+    const char *path_env = get_var("PATH");
+    if (path_env == NULL) {
+        return NULL;
+    }
+
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end != NULL ? (size_t)(end - dir) : strlen(dir);
+        char *candidate = malloc(dir_len + name_len + 2);
+        if (candidate == NULL) {
+            return NULL;
+        }
+        // An empty PATH entry means the current directory
+        if (dir_len == 0) {
+            memcpy(candidate, ".", 1);
+            dir_len = 1;
+        } else {
+            memcpy(candidate, dir, dir_len);
+        }
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+        if (access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        if (end == NULL) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+builtin_fn find_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return builtins[i].fn;
+        }
+    }
+    return NULL;
+}
+
+// Parse a line into stages, redirections and the background flag, resolving every executable
+struct plan *build_plan(int num_args, char **cmd_args) {
+    struct plan *plan = calloc(1, sizeof(struct plan));
+    if (plan == NULL) {
+        error_handling("Error - failed allocating a command plan");
+        return NULL;
+    }
+
+    // Check if the last argument is '&', indicating background execution
+    if (num_args > 0 && strcmp(cmd_args[num_args - 1], "&") == 0) {
+        plan->background = 1;
+    }
+
+    // Copy the tokens into the plan's own arena, the caller frees the line after this call
+    for (int i = 0; i < num_args; i++) {
+        plan->arena_len += strlen(cmd_args[i]) + 1;
+    }
+    plan->arena = malloc(plan->arena_len);
+    plan->argv_pool = malloc(sizeof(char *) * (num_args + 1));
+    plan->stages = calloc(num_args + 1, sizeof(struct stage));
+    if (plan->arena == NULL || plan->argv_pool == NULL || plan->stages == NULL) {
+        error_handling("Error - failed allocating a command plan");
+        return NULL;
+    }
+
+    char **tokens = malloc(sizeof(char *) * (num_args + 1));
+    if (tokens == NULL) {
+        error_handling("Error - failed allocating a command plan");
+        return NULL;
+    }
+    size_t offset = 0;
+    for (int i = 0; i < num_args; i++) {
+        size_t len = strlen(cmd_args[i]) + 1;
+        tokens[i] = memcpy(plan->arena + offset, cmd_args[i], len);
+        offset += len;
+    }
+
+    // Split into stages at '|', pulling '<' and '>' with their file names out of the argument lists.
+    // 'cmd |& { a , b , c }' ends the pipeline in branches that each get a copy of its output.
+    int end = plan->background ? num_args - 1 : num_args;
+    int start = parse_job_prefixes(plan, tokens, end);
+    int pool_index = 0;
+    struct stage *stage = &plan->stages[0];
+    stage->argv = plan->argv_pool;
+    plan->num_stages = 1;
+    const char *syntax_error = NULL;
+    int braces_open = 0;
+
+    if (plan->restart != RESTART_NONE && !plan->background) {
+        syntax_error = "supervise"; // Only a background job can be kept running
+    }
+
+    for (int i = start; i < end && syntax_error == NULL; i++) {
+        int branch = strcmp(tokens[i], ",") == 0 && braces_open;
+        int fanout = strcmp(tokens[i], "|&") == 0;
+        if (strcmp(tokens[i], "|") == 0 || branch || fanout) {
+            if (stage->argc == 0 || (braces_open && !branch)) {
+                syntax_error = tokens[i];
+            } else if (fanout && (plan->fanout || i + 1 >= end || strcmp(tokens[++i], "{") != 0)) {
+                syntax_error = "|&";
+            }
+            if (fanout) {
+                braces_open = 1;
+                plan->fanout = plan->num_stages;
+            }
+            plan->argv_pool[pool_index++] = NULL;
+            stage = &plan->stages[plan->num_stages++];
+            stage->argv = plan->argv_pool + pool_index;
+        } else if (braces_open && strcmp(tokens[i], "}") == 0) {
+            if (stage->argc == 0 || i + 1 != end) {
+                syntax_error = i + 1 != end ? tokens[i + 1] : "}";
+            }
+            braces_open = 0;
+        } else if (strcmp(tokens[i], "<") == 0 || strcmp(tokens[i], ">") == 0) {
+            if (i + 1 >= end) {
+                syntax_error = tokens[i];
+            } else if (tokens[i][0] == '<') {
+                stage->input_file = tokens[++i];
+            } else {
+                stage->output_file = tokens[++i];
+            }
+        } else {
+            plan->argv_pool[pool_index++] = tokens[i];
+            stage->argc++;
+        }
+    }
+    plan->argv_pool[pool_index] = NULL;
+    free(tokens);
+
+    if (syntax_error == NULL && (stage->argc == 0 || braces_open)) {
+        syntax_error = braces_open ? "newline" : plan->num_stages > 1 ? "|" : "newline";
+    }
+    if (syntax_error != NULL) {
+        fprintf(stderr, "myshell: syntax error near '%s'\n", syntax_error);
+        free_plan(plan);
+        return NULL;
+    }
+
+    // Resolve each command once, a cached plan keeps the result for every repeat of the line
+    for (int i = 0; i < plan->num_stages; i++) {
+        plan->stages[i].builtin = find_builtin(plan->stages[i].argv[0]);
+        if (plan->stages[i].builtin == NULL) {
+            plan->stages[i].path = resolve_executable(plan->stages[i].argv[0]);
+        }
+    }
+
+    // Rewritten once here, every cached repeat of the line runs the optimized plan
+    plan->optimized = option_optimize && optimize_plan(plan);
+    return plan;
+}
+
+// Consume the prefixes that apply to the whole job, returning the index of its first command word:
+//   timeout [-s SIGNAL] [-k GRACE] DURATION   signal the job's process group once DURATION has passed
+//   supervise [--restart=always|on-failure] [--backoff=exp]   restart a background job when it exits
+//   @cpus=LIST  @numa=NODES  @spread            where the job's processes run, e.g. @cpus=0-3,8
+//   limit KEY=VALUE...                          resource limits and scheduling, see parse_limit
+// A prefix whose arguments do not parse is left alone, it is then the command of that name.
+int parse_job_prefixes(struct plan *plan, char **tokens, int end) {
+    int i = 0;
+    while (i < end) {
+        if (strncmp(tokens[i], "@cpus=", 6) == 0) {
+            CPU_ZERO(&plan->placement.cpus);
+            if (!parse_id_list(tokens[i] + 6, &plan->placement.cpus)) {
+                return i;
+            }
+            plan->placement.pin_cpus = 1;
+            plan->cpus_spec = tokens[i++];
+            continue;
+        }
+        if (strncmp(tokens[i], "@numa=", 6) == 0) {
+            // The node's CPUs and its memory, as numactl --cpunodebind --membind would
+            cpu_set_t nodes;
+            CPU_ZERO(&nodes);
+            if (!parse_id_list(tokens[i] + 6, &nodes)) {
+                return i;
+            }
+            CPU_ZERO(&plan->placement.cpus);
+            plan->placement.mem_nodes = 0;
+            for (int node = 0; node < (int)(8 * sizeof(unsigned long)); node++) {
+                if (CPU_ISSET(node, &nodes) && add_node_cpus(node, &plan->placement.cpus)) {
+                    plan->placement.mem_nodes |= 1UL << node;
+                }
+            }
+            if (plan->placement.mem_nodes == 0) {
+                fprintf(stderr, "myshell: %s: no such NUMA node\n", tokens[i]);
+                return i;
+            }
+            plan->placement.pin_cpus = 1;
+            plan->numa_spec = tokens[i++];
+            continue;
+        }
+        if (strcmp(tokens[i], "limit") == 0) {
+            // At least one KEY=VALUE, else it is the builtin
+            int j = i + 1;
+            struct limits limits = plan->limits;
+            while (j < end && parse_limit(tokens[j], &limits)) {
+                j++;
+            }
+            if (j == i + 1) {
+                return i;
+            }
+            plan->limits = limits;
+            i = j;
+            continue;
+        }
+        if (strcmp(tokens[i], "@spread") == 0) {
+            plan->spread = 1;
+            i++;
+            continue;
+        }
+        if (strcmp(tokens[i], "supervise") == 0) {
+            int j = i + 1;
+            int restart = RESTART_ALWAYS, backoff = 0;
+            for (; j < end && strncmp(tokens[j], "--", 2) == 0; j++) {
+                if (strcmp(tokens[j], "--restart=always") == 0) {
+                    restart = RESTART_ALWAYS;
+                } else if (strcmp(tokens[j], "--restart=on-failure") == 0) {
+                    restart = RESTART_ON_FAILURE;
+                } else if (strcmp(tokens[j], "--backoff=exp") == 0) {
+                    backoff = 1;
+                } else {
+                    return i;
+                }
+            }
+            plan->restart = restart;
+            plan->backoff = backoff;
+            i = j;
+            continue;
+        }
+        if (strcmp(tokens[i], "timeout") != 0) {
+            break;
+        }
+        int j = i + 1;
+        int sig = SIGTERM;
+        uint64_t grace = 0, duration = 0;
+        while (j + 1 < end && (strcmp(tokens[j], "-k") == 0 || strcmp(tokens[j], "-s") == 0)) {
+            if (tokens[j][1] == 'k' ? !parse_duration(tokens[j + 1], &grace) : (sig = parse_signal(tokens[j + 1])) <= 0) {
+                return i;
+            }
+            j += 2;
+        }
+        if (j >= end || !parse_duration(tokens[j], &duration)) {
+            return i;
+        }
+        // As with timeout(1), a zero duration runs the command unbounded
+        plan->timeout_ns = duration;
+        plan->kill_after_ns = grace;
+        plan->timeout_signal = sig;
+        i = j + 1;
+    }
+    return i;
+}
+
+// A list of ids and ranges as the kernel writes them, "0-3,8,10-11", added to set
+int parse_id_list(const char *text, cpu_set_t *set) {
+    const char *p = text;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) {
+            return 0;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return 0;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return 0;
+        }
+        for (long id = first; id <= last; id++) {
+            CPU_SET(id, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0' && *end != '\n') {
+            return 0;
+        }
+        p = *end == '\n' ? end + 1 : end;
+    }
+    return p != text;
+}
+
+// An id list from sysfs
+int read_id_list(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    CPU_ZERO(set);
+    return parse_id_list(buf, set);
+}
+
+// Add the CPUs of a NUMA node to cpus, 0 if there is no such node
+int add_node_cpus(int node, cpu_set_t *cpus) {
+    char path[64];
+    cpu_set_t node_cpus;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (!read_id_list(path, &node_cpus)) {
+        return 0;
+    }
+    CPU_OR(cpus, cpus, &node_cpus);
+    return 1;
+}
+
+// '@spread': the next NUMA node in turn, CPUs and memory, or on a single node machine the next CPU the
+// shell may run on, so a batch of background jobs lands one per target
+void spread_placement(struct placement *placement) {
+    cpu_set_t targets;
+    int node_count = read_id_list("/sys/devices/system/node/online", &targets) ? CPU_COUNT(&targets) : 0;
+    int by_node = node_count > 1;
+    if (!by_node && sched_getaffinity(0, sizeof(targets), &targets) == -1) {
+        return;
+    }
+    int pick = spread_next++ % CPU_COUNT(&targets);
+    int target = 0;
+    for (int seen = -1; target < CPU_SETSIZE; target++) {
+        if (CPU_ISSET(target, &targets) && ++seen == pick) {
+            break;
+        }
+    }
+    CPU_ZERO(&placement->cpus);
+    if (by_node) {
+        add_node_cpus(target, &placement->cpus);
+        placement->mem_nodes = 1UL << target;
+    } else {
+        CPU_SET(target, &placement->cpus);
+    }
+    placement->pin_cpus = 1;
+}
+
+// Apply a job's placement in one of its children, before exec. A CPU set or node the kernel refuses is
+// reported and the command runs anyway.
+void apply_placement(const struct placement *placement) {
+    if (placement->pin_cpus && sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus) == -1) {
+        perror("myshell: sched_setaffinity");
+    }
+    if (placement->mem_nodes != 0 &&
+        syscall(SYS_set_mempolicy, MPOL_BIND, &placement->mem_nodes, 8 * sizeof(unsigned long) + 1) == -1) {
+        perror("myshell: set_mempolicy");
+    }
+}
+
+// One KEY=VALUE of 'limit' into limits, 0 if it is not one:
+//   mem=SIZE  nofile=N  cpu=DURATION  nice=N  sched=other|batch|idle  ionice=idle|be[:0-7]|rt[:0-7]
+int parse_limit(const char *text, struct limits *limits) {
+    const char *value = strchr(text, '=');
+    if (value == NULL) {
+        return 0;
+    }
+    size_t key_len = value - text;
+    value++;
+    char *end;
+    if (key_len == 3 && strncmp(text, "mem", 3) == 0) {
+        if (!parse_size(value, &limits->mem)) {
+            return 0;
+        }
+        limits->set |= LIMIT_MEM;
+    } else if (key_len == 6 && strncmp(text, "nofile", 6) == 0) {
+        unsigned long long n = strtoull(value, &end, 10);
+        if (end == value || *end != '\0') {
+            return 0;
+        }
+        limits->nofile = n;
+        limits->set |= LIMIT_NOFILE;
+    } else if (key_len == 3 && strncmp(text, "cpu", 3) == 0) {
+        uint64_t ns;
+        if (!parse_duration(value, &ns)) {
+            return 0;
+        }
+        // RLIMIT_CPU counts whole seconds, a fraction rounds up
+        limits->cpu = (ns + 999999999) / 1000000000;
+        limits->set |= LIMIT_CPU;
+    } else if (key_len == 4 && strncmp(text, "nice", 4) == 0) {
+        long n = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || n < -20 || n > 19) {
+            return 0;
+        }
+        limits->nice = (int)n;
+        limits->set |= LIMIT_NICE;
+    } else if (key_len == 5 && strncmp(text, "sched", 5) == 0) {
+        if (strcmp(value, "other") == 0) {
+            limits->sched = SCHED_OTHER;
+        } else if (strcmp(value, "batch") == 0) {
+            limits->sched = SCHED_BATCH;
+        } else if (strcmp(value, "idle") == 0) {
+            limits->sched = SCHED_IDLE;
+        } else {
+            return 0;
+        }
+        limits->set |= LIMIT_SCHED;
+    } else if (key_len == 6 && strncmp(text, "ionice", 6) == 0) {
+        int class, level = 4;
+        const char *colon = strchr(value, ':');
+        size_t name_len = colon != NULL ? (size_t)(colon - value) : strlen(value);
+        if (name_len == 4 && strncmp(value, "idle", 4) == 0 && colon == NULL) {
+            class = IOPRIO_CLASS_IDLE;
+            level = 0;
+        } else if (name_len == 2 && strncmp(value, "be", 2) == 0) {
+            class = IOPRIO_CLASS_BE;
+        } else if (name_len == 2 && strncmp(value, "rt", 2) == 0) {
+            class = IOPRIO_CLASS_RT;
+        } else {
+            return 0;
+        }
+        if (colon != NULL) {
+            level = (int)strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end != '\0' || level < 0 || level > 7) {
+                return 0;
+            }
+        }
+        limits->ioprio = class << IOPRIO_CLASS_SHIFT | level;
+        limits->set |= LIMIT_IONICE;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// A size in bytes with an optional K, M, G or T suffix, powers of 1024
+int parse_size(const char *text, rlim_t *size) {
+    char *end;
+    unsigned long long n = strtoull(text, &end, 10);
+    if (end == text || text[0] == '-') {
+        return 0;
+    }
+    const char *units = "KMGT";
+    if (*end != '\0') {
+        const char *unit = strchr(units, *end >= 'a' ? *end - 'a' + 'A' : *end);
+        if (unit == NULL || end[1] != '\0') {
+            return 0;
+        }
+        n <<= 10 * (unit - units + 1);
+    }
+    *size = n;
+    return 1;
+}
+
+// Fill in what limits does not set itself from defaults
+void merge_limits(struct limits *limits, const struct limits *defaults) {
+    struct limits merged = *defaults;
+    int set = limits->set;
+    if (set & LIMIT_MEM) {
+        merged.mem = limits->mem;
+    }
+    if (set & LIMIT_NOFILE) {
+        merged.nofile = limits->nofile;
+    }
+    if (set & LIMIT_CPU) {
+        merged.cpu = limits->cpu;
+    }
+    if (set & LIMIT_NICE) {
+        merged.nice = limits->nice;
+    }
+    if (set & LIMIT_SCHED) {
+        merged.sched = limits->sched;
+    }
+    if (set & LIMIT_IONICE) {
+        merged.ioprio = limits->ioprio;
+    }
+    merged.set |= set;
+    *limits = merged;
+}
+
+// Apply a job's limits in one of its children, before exec, in place of a nice, ionice and prlimit chain.
+// As with the placement, a setting the kernel refuses is reported and the command runs anyway.
+void apply_limits(const struct limits *limits) {
+    struct rlimit rl;
+    if (limits->set & LIMIT_MEM) {
+        rl.rlim_cur = rl.rlim_max = limits->mem;
+        if (setrlimit(RLIMIT_AS, &rl) == -1) {
+            perror("myshell: limit mem");
+        }
+    }
+    if (limits->set & LIMIT_NOFILE) {
+        rl.rlim_cur = rl.rlim_max = limits->nofile;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            perror("myshell: limit nofile");
+        }
+    }
+    if (limits->set & LIMIT_CPU) {
+        rl.rlim_cur = rl.rlim_max = limits->cpu;
+        if (setrlimit(RLIMIT_CPU, &rl) == -1) {
+            perror("myshell: limit cpu");
+        }
+    }
+    if (limits->set & LIMIT_SCHED) {
+        struct sched_param param = { 0 };
+        if (sched_setscheduler(0, limits->sched, &param) == -1) {
+            perror("myshell: limit sched");
+        }
+    }
+    // After sched, switching to SCHED_OTHER or SCHED_BATCH keeps the nice value but set it last anyway
+    if ((limits->set & LIMIT_NICE) && setpriority(PRIO_PROCESS, 0, limits->nice) == -1) {
+        perror("myshell: limit nice");
+    }
+    if ((limits->set & LIMIT_IONICE) && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, limits->ioprio) == -1) {
+        perror("myshell: limit ionice");
+    }
+}
+
+// The KEY=VALUE form of limits, each with a leading space
+void format_limits(const struct limits *limits, FILE *out) {
+    if (limits->set & LIMIT_MEM) {
+        fprintf(out, " mem=%llu", (unsigned long long)limits->mem);
+    }
+    if (limits->set & LIMIT_NOFILE) {
+        fprintf(out, " nofile=%llu", (unsigned long long)limits->nofile);
+    }
+    if (limits->set & LIMIT_CPU) {
+        fprintf(out, " cpu=%llus", (unsigned long long)limits->cpu);
+    }
+    if (limits->set & LIMIT_NICE) {
+        fprintf(out, " nice=%d", limits->nice);
+    }
+    if (limits->set & LIMIT_SCHED) {
+        fprintf(out, " sched=%s", limits->sched == SCHED_BATCH ? "batch" : limits->sched == SCHED_IDLE ? "idle" : "other");
+    }
+    if (limits->set & LIMIT_IONICE) {
+        int class = limits->ioprio >> IOPRIO_CLASS_SHIFT;
+        if (class == IOPRIO_CLASS_IDLE) {
+            fprintf(out, " ionice=idle");
+        } else {
+            fprintf(out, " ionice=%s:%d", class == IOPRIO_CLASS_RT ? "rt" : "be", limits->ioprio & 7);
+        }
+    }
+}
+
+// limit --background [KEY=VALUE... | -c] - the limits every background job gets unless its own 'limit' prefix
+// says otherwise; -c clears them. 'limit KEY=VALUE... cmd' itself is a prefix handled by build_plan.
+int builtin_limit(int argc, char **argv, FILE *out) {
+    if (argc < 2 || strcmp(argv[1], "--background") != 0) {
+        fprintf(stderr, "usage: limit KEY=VALUE... cmd, limit --background [KEY=VALUE... | -c]\n");
+        return 2;
+    }
+    if (argc == 2) {
+        fprintf(out, "limit --background");
+        format_limits(&background_limits, out);
+        fprintf(out, "\n");
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[2], "-c") == 0) {
+        memset(&background_limits, 0, sizeof(background_limits));
+        return 0;
+    }
+    struct limits limits = background_limits;
+    for (int i = 2; i < argc; i++) {
+        if (!parse_limit(argv[i], &limits)) {
+            fprintf(stderr, "myshell: limit: %s: invalid limit\n", argv[i]);
+            return 1;
+        }
+    }
+    background_limits = limits;
+    return 0;
+}
+
+// A duration in seconds with an optional s, m, h or d suffix, fractions allowed
+int parse_duration(const char *text, uint64_t *ns) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0 || (!(text[0] >= '0' && text[0] <= '9') && text[0] != '.')) {
+        return 0;
+    }
+    double unit = 1;
+    if (*end != '\0') {
+        const char *suffix = strchr("smhd", *end);
+        if (suffix == NULL || end[1] != '\0') {
+            return 0;
+        }
+        const double units[] = { 1, 60, 3600, 86400 };
+        unit = units[suffix - "smhd"];
+    }
+    *ns = (uint64_t)(value * unit * 1e9);
+    return 1;
+}
+
+// Peephole rules over the stages, applied until none matches. Returns how many rewrites were made.
+//   cat F | cmd   ->  cmd < F          one process and one pipe less, when F can be read
+//   cmd | cat     ->  cmd              the trailing cat only copied its input
+//   cat A > B     ->  copy in the shell with copy_file_range, no process at all
+int optimize_plan(struct plan *plan) {
+    int rewrites = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        struct stage *first = &plan->stages[0];
+        int linear = plan->fanout ? plan->fanout : plan->num_stages;
+
+        char *source = first->argc == 2 ? first->argv[1] : first->input_file;
+        // An unreadable F stays with cat, which reports it while cmd still runs on the empty input
+        if (linear > 1 && is_plain_cat(first) && first->output_file == NULL &&
+            first->argc + (first->input_file != NULL) == 2 && plan->stages[1].input_file == NULL &&
+            access(source, R_OK) == 0) {
+            plan->stages[1].input_file = source;
+            remove_stage(plan, 0);
+            changed = 1;
+        } else if (!plan->fanout && plan->num_stages > 1 && is_plain_cat(&plan->stages[plan->num_stages - 1]) &&
+                   plan->stages[plan->num_stages - 1].argc == 1 &&
+                   plan->stages[plan->num_stages - 1].input_file == NULL &&
+                   plan->stages[plan->num_stages - 1].output_file == NULL) {
+            remove_stage(plan, plan->num_stages - 1);
+            changed = 1;
+        } else if (plan->num_stages == 1 && is_plain_cat(first) && first->argc == 2 &&
+                   first->input_file == NULL && first->output_file != NULL && first->builtin == NULL) {
+            first->builtin = builtin_copy;
+            changed = 1;
+        }
+        rewrites += changed;
+    }
+    return rewrites;
+}
+
+// cat run from PATH with no options, which a function of the same name does not shadow
+int is_plain_cat(const struct stage *stage) {
+    return strcmp(stage->argv[0], "cat") == 0 && stage->builtin == NULL && find_function("cat") == NULL &&
+           (stage->argc < 2 || stage->argv[1][0] != '-');
+}
+
+void remove_stage(struct plan *plan, int index) {
+    free(plan->stages[index].path);
+    memmove(&plan->stages[index], &plan->stages[index + 1], sizeof(struct stage) * (plan->num_stages - index - 1));
+    plan->num_stages--;
+    if (plan->fanout > index) {
+        plan->fanout--;
+    }
+}
+
+// Write a plan back as a command line, as set -o explain shows it
+void format_plan(const struct plan *plan, FILE *out) {
+    if (plan->cpus_spec != NULL) {
+        fprintf(out, " %s", plan->cpus_spec);
+    }
+    if (plan->numa_spec != NULL) {
+        fprintf(out, " %s", plan->numa_spec);
+    }
+    if (plan->spread) {
+        fprintf(out, " @spread");
+    }
+    if (plan->limits.set != 0) {
+        fprintf(out, " limit");
+        format_limits(&plan->limits, out);
+    }
+    if (plan->restart != RESTART_NONE) {
+        fprintf(out, " supervise%s%s", plan->restart == RESTART_ON_FAILURE ? " --restart=on-failure" : "",
+                plan->backoff ? " --backoff=exp" : "");
+    }
+    if (plan->timeout_ns != 0) {
+        fprintf(out, " timeout");
+        if (plan->timeout_signal != SIGTERM) {
+            fprintf(out, " -s %s", sigabbrev_np(plan->timeout_signal));
+        }
+        if (plan->kill_after_ns != 0) {
+            fprintf(out, " -k %gs", plan->kill_after_ns / 1e9);
+        }
+        fprintf(out, " %gs", plan->timeout_ns / 1e9);
+    }
+    for (int i = 0; i < plan->num_stages; i++) {
+        const struct stage *stage = &plan->stages[i];
+        if (i > 0) {
+            fprintf(out, i == plan->fanout ? " |& {" : plan->fanout && i > plan->fanout ? " ," : " |");
+        }
+        if (stage->builtin == builtin_copy) {
+            fprintf(out, " [copy_file_range]");
+        }
+        for (int j = 0; j < stage->argc; j++) {
+            fprintf(out, " %s", stage->argv[j]);
+        }
+        if (stage->input_file != NULL) {
+            fprintf(out, " < %s", stage->input_file);
+        }
+        if (stage->output_file != NULL) {
+            fprintf(out, " > %s", stage->output_file);
+        }
+    }
+    if (plan->fanout) {
+        fprintf(out, " }");
+    }
+    if (plan->background) {
+        fprintf(out, " &");
+    }
+}
+
+// 'cat A > B' as the optimizer runs it: the kernel copies A into the already opened B
+int builtin_copy(int argc, char **argv, FILE *out) {
+    (void)argc;
+    int in = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        fprintf(stderr, "cat: %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    fflush(out);
+    int fd = fileno(out);
+    int status = 0;
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, fd, NULL, RELAY_CHUNK, 0)) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            // Not supported between these files, plain reads and writes do the rest
+            char buf[65536];
+            while ((n = read(in, buf, sizeof(buf))) > 0 && write_all(fd, buf, n) == 0) {
+            }
+            if (n != 0) {
+                fprintf(stderr, "cat: %s: %s\n", argv[1], strerror(errno));
+                status = 1;
+            }
+            break;
+        }
+    }
+    close(in);
+    return status;
+}
+
+void free_plan(struct plan *plan) {
+    if (plan == NULL) {
+        return;
+    }
+    if (plan->stages != NULL) {
+        for (int i = 0; i < plan->num_stages; i++) {
+            free(plan->stages[i].path);
+        }
+    }
+    free(plan->stages);
+    free(plan->argv_pool);
+    free(plan->arena);
+    free(plan);
+}
+
+int run_plan(struct plan *plan) {
+    // Reported here rather than in build_plan, so a line served from the plan cache is explained too
+    if (plan->optimized && option_explain) {
+        fprintf(stderr, "myshell: explain:");
+        for (size_t offset = 0; offset < plan->arena_len; offset += strlen(plan->arena + offset) + 1) {
+            fprintf(stderr, " %s", plan->arena + offset);
+        }
+        fprintf(stderr, " =>");
+        format_plan(plan, stderr);
+        fprintf(stderr, "\n");
+    }
+
+    // Built here in the shell, so children inherit it instead of each rebuilding it after fork
+    get_envp();
+
+    // Every job gets a process group of its own, led by its first process; a foreground one only when the
+    // shell can give it the terminal, or when 'timeout' has to signal it apart from the shell
+    // An instance of a supervised job runs in a shell of its own, which does not have this one's functions
+    for (int i = 0; plan->restart != RESTART_NONE && i < plan->num_stages; i++) {
+        if (find_function(plan->stages[i].argv[0]) != NULL) {
+            fprintf(stderr, "myshell: supervise: %s: a shell function cannot be supervised\n", plan->stages[i].argv[0]);
+            last_status = 1;
+            return 1;
+        }
+    }
+
+    job_pgid = 0;
+    job_plan = plan;
+    job_placement = plan->placement;
+    if (plan->spread) {
+        spread_placement(&job_placement);
+    }
+    job_limits = plan->limits;
+    if (plan->background) {
+        merge_limits(&job_limits, &background_limits);
+    }
+    job_own_group = plan->background || job_control || plan->timeout_ns != 0;
+    int forks = plan->num_stages > 1 || plan->background || plan->stages[0].builtin == NULL;
+    if (forks && job_cgroups_active()) {
+        create_job_cgroup();
+    }
+    if (plan->background) {
+        pthread_mutex_lock(&jobs_lock);
+        starting_job = new_job(plan);
+        if (starting_job != NULL && job_cgroup_fd != -1) {
+            // The job owns its cgroup from here on, the monitor accounts for it when the job ends
+            starting_job->cgroup_fd = job_cgroup_fd;
+            strcpy(starting_job->cgroup_name, job_cgroup_name);
+        }
+        if (starting_job != NULL && (option_jobpipes || option_joblog)) {
+            open_job_output(starting_job, plan->restart != RESTART_NONE);
+        }
+        pthread_mutex_unlock(&jobs_lock);
+        // Reusing a slot drained what its last job had left in its pipes
+        flush_emitted_lines();
+    }
+
+    int result;
+    if (plan->restart != RESTART_NONE) {
+        // Supervised, started and restarted from the job's own copy of the plan
+        result = start_supervised(plan);
+    } else if (plan->num_stages > 1 && option_pipestat && !plan->fanout) {
+        // Handle pipe, measured by a relay between every two stages
+        result = establish_relayed_pipe(plan);
+    } else if (plan->num_stages > 1) {
+        // Handle pipe
+        result = establish_pipe(plan);
+    } else if (plan->stages[0].builtin != NULL && !plan->background) {
+        // Shell-internal command, runs in the shell process itself
+        result = run_builtin(&plan->stages[0]);
+    } else if (plan->background) {
+        // Execute asynchronously
+        result = execute_async(&plan->stages[0]);
+    } else {
+        // Execute synchronously
+        result = execute_sync(&plan->stages[0]);
+    }
+
+    if (starting_job != NULL) {
+        pthread_mutex_lock(&jobs_lock);
+        if (starting_job->output_streams > 0) {
+            hand_over_job_output(starting_job);
+        }
+        if (plan->restart == RESTART_NONE) {
+            starting_job->pgid = job_pgid;
+            if (starting_job->timeout_ns != 0 && starting_job->remaining > 0) {
+                arm_job_timer(starting_job, starting_job->timeout_ns, TIMER_SIGNAL);
+            }
+        }
+        if (job_control) {
+            fprintf(stderr, "[%d] %d\n", starting_job->id, (int)starting_job->pgid);
+        }
+        starting_job = NULL;
+        pthread_mutex_unlock(&jobs_lock);
+        job_cgroup_fd = -1;
+    }
+    if (job_cgroup_fd != -1) {
+        // A foreground job is over, or a background one could not be listed: account for it now
+        read_cgroup_stats(job_cgroup_fd, &last_job_stats);
+        describe_plan(plan, last_job_command, sizeof(last_job_command));
+        close(job_cgroup_fd);
+        unlinkat(cgroup_session_fd, job_cgroup_name, AT_REMOVEDIR);
+        job_cgroup_fd = -1;
+    }
+    job_plan = NULL;
+    return result;
+}
+
+// Run a builtin in the shell, honoring '>' without touching the shell's own stdout
+int run_builtin(struct stage *stage) {
+    FILE *out = stdout;
+    if (stage->output_file != NULL && (out = fopen(stage->output_file, "w")) == NULL) {
+        perror("Error - unable to open or create the specified file for redirection");
+        last_status = 1;
+        return 1;
+    }
+    last_status = stage->builtin(stage->argc, stage->argv, out);
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(stdout);
+    }
+    return 1;
+}
+
+// plancache [-c] - report the plan cache counters, or clear the cache
+int builtin_plancache(int argc, char **argv, FILE *out) {
+    int used = 0;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        flush_plan_cache();
+        plan_cache_hits = plan_cache_misses = 0;
+        return 0;
+    }
+    for (int i = 0; i < PLAN_CACHE_SIZE; i++) {
+        used += plan_cache[i].plan != NULL;
+    }
+    fprintf(out, "hits %lu misses %lu entries %d/%d\n", plan_cache_hits, plan_cache_misses, used, PLAN_CACHE_SIZE);
+    return 0;
+}
+
+// export [NAME[=VALUE]...] - mark variables for the environment of commands, or list the exported ones
+int builtin_export(int argc, char **argv, FILE *out) {
+    int status = 0;
+    if (argc == 1) {
+        char **envp = get_envp();
+        for (int i = 0; envp[i] != NULL; i++) {
+            fprintf(out, "export %s\n", envp[i]);
+        }
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        size_t name_len = eq != NULL ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+        if (!is_valid_name(argv[i], name_len)) {
+            fprintf(stderr, "myshell: export: '%s': not a valid name\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        char *name = strndup(argv[i], name_len);
+        struct shell_var *var = find_var(name, 1);
+        if (!var->exported) {
+            var->exported = 1;
+            var_changed(var, 0);
+        }
+        if (eq != NULL) {
+            set_var(name, eq + 1);
+        }
+        free(name);
+    }
+    return status;
+}
+
+// unset NAME... - remove variables, and from the environment of commands if they were exported
+int builtin_unset(int argc, char **argv, FILE *out) {
+    (void)out;
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!is_valid_name(argv[i], strlen(argv[i]))) {
+            fprintf(stderr, "myshell: unset: '%s': not a valid name\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        unset_var(argv[i]);
+    }
+    return status;
+}
+
+// set [-o|+o NAME] - turn a shell option on or off, or list them with set -o
+int builtin_set(int argc, char **argv, FILE *out) {
+    size_t num_options = sizeof(shell_options) / sizeof(shell_options[0]);
+    if (argc == 1 || (argc == 2 && strcmp(argv[1], "-o") == 0)) {
+        for (size_t i = 0; i < num_options; i++) {
+            fprintf(out, "%-15s %s\n", shell_options[i].name, *shell_options[i].value ? "on" : "off");
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        int enable = strcmp(argv[i], "-o") == 0;
+        if ((!enable && strcmp(argv[i], "+o") != 0) || i + 1 == argc) {
+            fprintf(stderr, "myshell: set: usage: set [-o|+o option]\n");
+            return 2;
+        }
+        const char *name = argv[++i];
+        size_t j = 0;
+        while (j < num_options && strcmp(shell_options[j].name, name) != 0) {
+            j++;
+        }
+        if (j == num_options) {
+            fprintf(stderr, "myshell: set: %s: invalid option name\n", name);
+            status = 1;
+            continue;
+        }
+        *shell_options[j].value = enable;
+    }
+    // Cached plans were built under the old options
+    plan_cache_stale = 1;
+    return status;
+}
+
+int execute_sync(struct stage *stage) {
+    // Spawn a child process to execute the command, then wait for its completion before accepting another command
+    pid_t child_pid = fork_into_job(stage);
+    if (child_pid == -1) { // Forking was failed
+        error_handling("Failed to create a child process");
+        return 0; // An error occurred in the original process, causing process_arglist to return 0
+    
+     // Child process handling
+    } else if (child_pid == 0) { 
+        is_child_process = 1;
+        enter_job_group(0, 0);
+        // Set up signal handling for the child process
+        if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
+            // Handle SIGINT in foreground child processes
+            error_handling("Failed to adjust SIGINT handling in the child process");
+        }
+        // Execute the command in the child process
+        execute_child(stage);
+    }
+
+    
+    // Parent process handling
+    // Wait for the child process to complete, an error causes process_arglist to return 0
+    enter_job_group(child_pid, 0);
+    return wait_for_job(&child_pid, 1);
+}
+
+
+void execute_child(struct stage *stage) {
+
+    // Restore default SIGCHLD handling in case execvp doesn't modify signals
+    if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+        error_handling("Error: Unable to reset the SIGCHLD signal handling");
+    }
+    // Ignored dispositions survive exec, SIGTTOU is only ignored for the shell's own tcsetpgrp
+    signal(SIGTTOU, SIG_DFL);
+
+    // CPU affinity, memory policy, limits and scheduling survive exec as well
+    apply_placement(&job_placement);
+    apply_limits(&job_limits);
+
+    // This is the command the line's process substitutions were made for, its exec keeps their pipe ends
+    for (int i = 0; i < num_process_substitutions; i++) {
+        fcntl(process_substitution_fds[i], F_SETFD, 0);
+    }
+
+    // Apply '<' and '>' before the command starts
+    apply_redirections(stage);
+
+    // A shell function inside a pipeline or in the background runs in this child
+    struct function *fn = find_function(stage->argv[0]);
+    if (fn != NULL) {
+        call_function(fn, stage->argc, stage->argv);
+        fflush(stdout);
+        _exit(last_status);
+    }
+
+    // A builtin inside a pipeline or in the background runs in this child instead of an exec
+    if (stage->builtin != NULL) {
+        int status = stage->builtin(stage->argc, stage->argv, stdout);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    // Execute the command in the child process, using the path resolved when the plan was built
+    if (stage->path != NULL) {
+        execve(stage->path, stage->argv, shell_envp);
+    }
+    if (execvpe(stage->argv[0], stage->argv, shell_envp) == -1) {
+        error_handling("Error - execution of the command failed");
+    }
+}
+
+// Execute a command asynchronously, spawning a child process
+int execute_async(struct stage *stage) {
+    // Fork to create a child process that executes the command without waiting for completion.
+    // An instant exit leaves a zombie the pidfd opened by track_background_child still refers to.
+    pid_t child_pid = fork_into_job(stage);
+    if (child_pid == -1) { // Forking failed
+        error_handling("Error: Unable to create a new process");
+        return 0; // Error in the original process, causing process_arglist to return 0
+     
+     // Child process handling
+    }else if (child_pid == 0) { 
+        is_child_process = 1;
+        enter_job_group(0, 1);
+        // The execute_child function includes child execution logic and handles errors
+        execute_child(stage);
+        // If it returns, an error occurred, and the child process exits
+        _exit(EXIT_FAILURE); // Ensure the child process exits even if execute_child returns unexpectedly
+    }
+    
+    // Parent process handling
+    enter_job_group(child_pid, 1);
+    track_background_child(child_pid);
+    last_status = 0;
+    // No errors occurred in the parent, allowing the shell to handle another command
+    return 1; 
+}
+
+// External function to wait for a child process and handle errors
+int wait_and_handle_error(pid_t child_pid, const char *error_message) {
+    int status;
+    if (waitpid(child_pid, &status, 0) == -1) {
+        if (errno != ECHILD && errno != EINTR) {
+            // Ignore ECHILD and EINTR in the parent shell after waitpid, as they are not considered errors
+            perror(error_message);
+            return 0; // An error occurred
+        }
+    } else {
+        record_status(status);
+    }
+
+    return 1; // No error
+}
+
+// Helper function to turn a wait status into the shell's exit status, 128 + signal for killed commands
+void record_status(int status) {
+    if (WIFEXITED(status)) {
+        last_status = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        last_status = 128 + WTERMSIG(status);
+    }
+}
+
+// Fork a child of the shell's own, listed in own_children before the monitor could see it as an orphan
+pid_t fork_own_child(int cgroup_fd, int will_exec) {
+    pthread_mutex_lock(&jobs_lock);
+    if (num_own_children == MAX_OWN_CHILDREN) {
+        prune_own_children();
+    }
+    pid_t pid = fork_into_cgroup(cgroup_fd, will_exec);
+    if (pid > 0 && num_own_children < MAX_OWN_CHILDREN) {
+        own_children[num_own_children++] = pid;
+    }
+    // The child has its own copy of the lock, held as the parent held it
+    pthread_mutex_unlock(&jobs_lock);
+    return pid;
+}
+
+// The children of every thread of the shell, zombies included, from /proc/self/task/<tid>/children
+int list_children(pid_t *children, int max) {
+    int count = 0;
+    DIR *tasks = opendir("/proc/self/task");
+    struct dirent *entry;
+    while (tasks != NULL && (entry = readdir(tasks)) != NULL) {
+        char path[300];
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/self/task/%s/children", entry->d_name);
+        FILE *in = fopen(path, "re");
+        int pid;
+        while (in != NULL && count < max && fscanf(in, "%d", &pid) == 1) {
+            children[count++] = pid;
+        }
+        if (in != NULL) {
+            fclose(in);
+        }
+    }
+    if (tasks != NULL) {
+        closedir(tasks);
+    }
+    return count;
+}
+
+// Drop the children of the shell's own that were reaped since they were forked. Under jobs_lock.
+void prune_own_children(void) {
+    static pid_t children[MAX_OWN_CHILDREN + MAX_BACKGROUND_CHILDREN];
+    int count = list_children(children, sizeof(children) / sizeof(children[0]));
+    int kept = 0;
+    for (int i = 0; i < num_own_children; i++) {
+        int alive = 0;
+        for (int c = 0; c < count && !alive; c++) {
+            alive = children[c] == own_children[i];
+        }
+        if (alive) {
+            own_children[kept++] = own_children[i];
+        }
+    }
+    num_own_children = kept;
+}
+
+// Watch the orphans reparented to the shell since the last look, counted into the job they came from so it
+// lasts, and accounts, until they are reaped as well. Under jobs_lock.
+void adopt_orphans(void) {
+    static pid_t children[MAX_OWN_CHILDREN + MAX_BACKGROUND_CHILDREN];
+    if (orphan_eventfd == -1) {
+        return;
+    }
+    int count = list_children(children, sizeof(children) / sizeof(children[0]));
+    for (int c = 0; c < count; c++) {
+        int known = 0;
+        for (int i = 0; i < num_own_children && !known; i++) {
+            known = own_children[i] == children[c];
+        }
+        for (int i = 0; i < MAX_BACKGROUND_CHILDREN && !known; i++) {
+            known = child_watches[i].pid == children[c];
+        }
+        if (!known) {
+            watch_child(children[c], orphan_job(children[c]));
+        }
+    }
+}
+
+// The running job an orphan belongs to: the one whose process group it is still in, or else the one whose
+// cgroup it is in, which a new session does not leave. NULL when it left both.
+struct job *orphan_job(pid_t pid) {
+    pid_t pgid = getpgid(pid);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].remaining > 0 && jobs[i].pgid != 0 && jobs[i].pgid == pgid) {
+            return &jobs[i];
+        }
+    }
+    char path[64], line[4096] = "", suffix[64];
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+    FILE *in = fopen(path, "re");
+    int found = 0;
+    while (in != NULL && !found && fgets(line, sizeof(line), in) != NULL) {
+        found = strncmp(line, "0::", 3) == 0;
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    line[strcspn(line, "\n")] = '\0';
+    for (int i = 0; found && i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].remaining > 0 && jobs[i].cgroup_name[0] != '\0') {
+            int len = snprintf(suffix, sizeof(suffix), "/myshell-%d/%s", (int)getpid(), jobs[i].cgroup_name);
+            size_t line_len = strlen(line);
+            if (line_len >= (size_t)len && strcmp(line + line_len - len, suffix) == 0) {
+                return &jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// SIGCHLD while the shell is a subreaper: an orphan may have exited, the monitor looks for it
+void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    uint64_t one = 1;
+    if (write(orphan_eventfd, &one, sizeof(one)) == -1) {
+        // Already pending, the monitor looks once for all of them
+    }
+    errno = saved_errno;
+}
+
+// Add a reaped process's rusage to a job's totals, in the form of its cgroup accounting
+void add_rusage(struct cgroup_stats *usage, const struct rusage *ru) {
+    uint64_t user = ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec;
+    uint64_t system = ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+    usage->valid = 1;
+    usage->user_usec += user;
+    usage->system_usec += system;
+    usage->usage_usec += user + system;
+    if ((uint64_t)ru->ru_maxrss * 1024 > usage->memory_peak) {
+        usage->memory_peak = (uint64_t)ru->ru_maxrss * 1024;
+    }
+    usage->read_bytes += (uint64_t)ru->ru_inblock * 512;
+    usage->write_bytes += (uint64_t)ru->ru_oublock * 512;
+}
+
+// Watch a background child: the job monitor reaps it once its pidfd turns readable. A child that has already
+// exited is a zombie until then, so its pidfd can still be opened.
+void track_background_child(pid_t pid) {
+    pthread_mutex_lock(&jobs_lock);
+    watch_child(pid, starting_job);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// Add a child of a job, or of none, to the monitor's epoll set, starting the monitor on first use. Under jobs_lock.
+void watch_child(pid_t pid, struct job *job) {
+    if (monitor_epfd == -1) {
+        pthread_t thread;
+        sigset_t all, saved;
+        monitor_epfd = epoll_create1(EPOLL_CLOEXEC);
+        // Created with every signal blocked, signals stay with the shell's main thread
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        if (monitor_epfd == -1 || pthread_create(&thread, NULL, job_monitor, NULL) != 0) {
+            error_handling("Error - failed starting the job monitor");
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        pthread_detach(thread);
+        // From now on orphaned descendants of the jobs come to the shell, to be counted into their job
+        struct sigaction sa = { 0 };
+        sa.sa_handler = sigchld_handler;
+        sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        orphan_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = MONITOR_ORPHANS };
+        if (orphan_eventfd != -1 && epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, orphan_eventfd, &ev) == 0 &&
+            sigaction(SIGCHLD, &sa, NULL) == 0) {
+            prctl(PR_SET_CHILD_SUBREAPER, 1);
+        }
+    }
+    int i = 0;
+    while (i < MAX_BACKGROUND_CHILDREN && child_watches[i].pid != 0) {
+        i++;
+    }
+    int pidfd = i < MAX_BACKGROUND_CHILDREN ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+    if (pidfd == -1) {
+        fprintf(stderr, "myshell: unable to watch background child %d, it will not be reaped\n", (int)pid);
+        return;
+    }
+    child_watches[i] = (struct child_watch){ pid, pidfd, job };
+    if (job != NULL) {
+        job->remaining++;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+    epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, pidfd, &ev);
+}
+
+// Job monitor thread: one epoll set holds the pidfd of every background child and the timerfd of every job
+// with a timeout or a pending restart. Event data below MAX_BACKGROUND_CHILDREN is a child_watches slot,
+// above it a jobs slot.
+void *job_monitor(void *arg) {
+    (void)arg;
+    struct epoll_event events[64];
+    while (1) {
+        int ready = epoll_wait(monitor_epfd, events, 64, -1);
+        pthread_mutex_lock(&jobs_lock);
+        for (int e = 0; e < ready; e++) {
+            uint32_t id = events[e].data.u32;
+            if (id == MONITOR_ORPHANS) {
+                uint64_t count;
+                if (read(orphan_eventfd, &count, sizeof(count)) == sizeof(count)) {
+                    adopt_orphans();
+                }
+            } else if (id >= MONITOR_OUTPUT) {
+                drain_job_output(&jobs[(id - MONITOR_OUTPUT) / 2], (id - MONITOR_OUTPUT) % 2);
+            } else if (id < MAX_BACKGROUND_CHILDREN) {
+                reap_watched_child(&child_watches[id]);
+            } else {
+                job_timer_fired(&jobs[id - MAX_BACKGROUND_CHILDREN]);
+            }
+        }
+        int emitted = emitted_lines[0].len > 0 || emitted_lines[1].len > 0;
+        pthread_mutex_unlock(&jobs_lock);
+        if (emitted) {
+            flush_emitted_lines();
+        }
+    }
+    return NULL;
+}
+
+// Reap a watched child whose pidfd turned readable and count it out of its job
+void reap_watched_child(struct child_watch *watch) {
+    int status;
+    struct rusage usage;
+    if (watch->pid == 0 || wait4(watch->pid, &status, WNOHANG, &usage) <= 0) {
+        return;
+    }
+    epoll_ctl(monitor_epfd, EPOLL_CTL_DEL, watch->pidfd, NULL);
+    close(watch->pidfd);
+    struct job *job = watch->job;
+    pid_t pid = watch->pid;
+    watch->pid = 0;
+    watch->job = NULL;
+    if (job != NULL) {
+        add_rusage(&job->usage, &usage);
+        // Its children that are still running were reparented to the shell as it exited
+        adopt_orphans();
+        if (job->restart != RESTART_NONE && pid == job->leader) {
+            supervised_exit(job, status);
+        }
+        job_process_done(job);
+    }
+}
+
+// One process of a job is gone; the last one ends the job and releases what it holds
+void job_process_done(struct job *job) {
+    if (--job->remaining > 0) {
+        return;
+    }
+    if (job->cgroup_name[0] != '\0') {
+        read_cgroup_stats(job->cgroup_fd, &job->stats);
+        if (unlinkat(cgroup_session_fd, job->cgroup_name, AT_REMOVEDIR) == 0) {
+            close(job->cgroup_fd);
+            job->cgroup_name[0] = '\0';
+        }
+    }
+    if (job->timer != -1) {
+        close(job->timer);
+        job->timer = -1;
+        job->timer_action = TIMER_NONE;
+    }
+    if (job->holds_output_write) {
+        // No instance is coming any more, the pipes reach EOF when the last writer is gone
+        for (int stream = 0; stream < job->output_streams; stream++) {
+            close(job->output_write[stream]);
+        }
+        job->holds_output_write = 0;
+    }
+    for (int i = 0; job->instance_argv != NULL && job->instance_argv[i] != NULL; i++) {
+        free(job->instance_argv[i]);
+    }
+    free(job->instance_argv);
+    job->instance_argv = NULL;
+    for (int i = 0; job->envp != NULL && job->envp[i] != NULL; i++) {
+        free(job->envp[i]);
+    }
+    free(job->envp);
+    job->envp = NULL;
+}
+
+// A job's timer: restart a supervised job after its delay, or enforce the timeout of a background one
+void job_timer_fired(struct job *job) {
+    uint64_t ticks;
+    if (job->timer == -1 || read(job->timer, &ticks, sizeof(ticks)) == -1) {
+        return;
+    }
+    enum job_timer_action action = job->timer_action;
+    job->timer_action = TIMER_NONE;
+    if (action == TIMER_RESTART) {
+        if (job->stopping) {
+            job_process_done(job); // Release the supervisor's hold, nothing runs any more
+        } else {
+            job->restarts++;
+            spawn_instance(job);
+        }
+    } else if (action == TIMER_SIGNAL || action == TIMER_KILL) {
+        killpg(job->pgid, action == TIMER_SIGNAL ? job->timeout_signal : SIGKILL);
+        killpg(job->pgid, SIGCONT);
+        if (action == TIMER_SIGNAL && job->kill_after_ns != 0) {
+            arm_job_timer(job, job->kill_after_ns, TIMER_KILL);
+        }
+    }
+}
+
+// (Re)arm a job's one-shot timer, creating it and adding it to the monitor's epoll set on first use
+void arm_job_timer(struct job *job, uint64_t delay_ns, enum job_timer_action action) {
+    if (job->timer == -1) {
+        job->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = MAX_BACKGROUND_CHILDREN + (job - jobs) };
+        if (job->timer == -1 || epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, job->timer, &ev) == -1) {
+            fprintf(stderr, "myshell: unable to arm a timer for job %d\n", job->id);
+            return;
+        }
+    }
+    struct itimerspec when = { { 0, 0 }, { delay_ns / 1000000000, delay_ns % 1000000000 } };
+    timerfd_settime(job->timer, 0, &when, NULL);
+    job->timer_action = action;
+}
+
+// Start a supervised job: it keeps a copy of its plan and of the environment, which an instance started from
+// the monitor thread later uses without touching the shell's own state. The job holds one count of its own
+// until the supervisor gives up on it.
+int start_supervised(struct plan *plan) {
+    pthread_mutex_lock(&jobs_lock);
+    struct job *job = starting_job;
+    if (job == NULL) {
+        pthread_mutex_unlock(&jobs_lock);
+        fprintf(stderr, "myshell: supervise: too many jobs\n");
+        last_status = 1;
+        return 1;
+    }
+    job->instance_argv = instance_argv(plan);
+    char **envp = get_envp();
+    int count = 0;
+    while (envp[count] != NULL) {
+        count++;
+    }
+    job->envp = malloc(sizeof(char *) * (count + 1));
+    if (job->instance_argv == NULL || job->envp == NULL) {
+        error_handling("Error - failed allocating a supervised job");
+    }
+    for (int i = 0; i < count; i++) {
+        job->envp[i] = strdup(envp[i]);
+    }
+    job->envp[count] = NULL;
+    job->restart = plan->restart;
+    job->backoff = plan->backoff;
+    job->remaining = 1;
+    spawn_instance(job);
+    pthread_mutex_unlock(&jobs_lock);
+    last_status = 0;
+    return 1;
+}
+
+// Fork one instance of a supervised job into a new process group, by the shell or by the monitor, under
+// jobs_lock. A single command is exec'd in it; a pipeline is run by it as a foreground job, so an instance
+// is one process whose exit the monitor sees.
+void spawn_instance(struct job *job) {
+    // Straight into the cgroup, the child does nothing but exec
+    pid_t pid = fork_into_cgroup(job->cgroup_name[0] != '\0' ? job->cgroup_fd : -1, 1);
+    if (pid == -1) {
+        fprintf(stderr, "myshell: supervise: unable to start %s: %s\n", job->command, strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        // From the monitor thread the main thread may hold any lock, stdio's and malloc's included: up to
+        // the exec the child makes async-signal-safe calls only
+        setpgid(0, 0);
+        if (job->holds_output_write) {
+            dup2(job->output_write[0], STDOUT_FILENO);
+            dup2(job->output_write[job->output_streams - 1], STDERR_FILENO);
+        }
+        // Those of a job the shell is starting meanwhile are not this instance's to hold open
+        if (job_output_fds[0] != -1) {
+            close(job_output_fds[0]);
+            if (job_output_fds[1] != job_output_fds[0]) {
+                close(job_output_fds[1]);
+            }
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve("/proc/self/exe", job->instance_argv, job->envp);
+        static const char failed[] = "myshell: supervise: unable to exec the shell for an instance\n";
+        if (write(STDERR_FILENO, failed, sizeof(failed) - 1) == -1) {
+            // Nowhere to report it, the exit status still tells
+        }
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    job->pgid = job->leader = pid;
+    job->started_ns = monotonic_ns();
+    watch_child(pid, job);
+    if (job->timeout_ns != 0) {
+        arm_job_timer(job, job->timeout_ns, TIMER_SIGNAL);
+    }
+}
+
+// The current instance of a supervised job exited: restart it after a delay if the policy says so,
+// otherwise release the supervisor's hold so the job ends with this process
+void supervised_exit(struct job *job, int status) {
+    job->leader = 0;
+    int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    if (job->stopping || (job->restart == RESTART_ON_FAILURE && !failed)) {
+        job->remaining--;
+        return;
+    }
+    uint64_t ran = monotonic_ns() - job->started_ns;
+    job->quick_exits = ran >= SUPERVISE_STABLE_NS ? 0 : job->quick_exits + 1;
+    uint64_t delay = SUPERVISE_DELAY_NS;
+    if (job->backoff) {
+        int shift = job->quick_exits > 1 ? job->quick_exits - 1 : 0;
+        delay = shift >= 16 ? SUPERVISE_MAX_DELAY_NS : SUPERVISE_DELAY_NS << shift;
+        delay = delay > SUPERVISE_MAX_DELAY_NS ? SUPERVISE_MAX_DELAY_NS : delay;
+    }
+    arm_job_timer(job, delay, TIMER_RESTART);
+}
+
+// The arguments an instance of a supervised job is exec'd with: the placement and limits the job started
+// with, '@spread' and 'limit --background' resolved, then its words without the job's prefixes and the '&'.
+// The shell they start runs them as a foreground job and exits with its status.
+char **instance_argv(const struct plan *plan) {
+    int count = 0;
+    for (size_t i = 0; i < plan->arena_len; i++) {
+        count += plan->arena[i] == '\0';
+    }
+    char **tokens = malloc(sizeof(char *) * (count + 1));
+    // myshell -c-instance, @numa=, @cpus=, limit and its six KEY=VALUE at most, the words, NULL
+    char **argv = malloc(sizeof(char *) * (count + 12));
+    char *limits = NULL;
+    size_t limits_len = 0;
+    FILE *out = open_memstream(&limits, &limits_len);
+    if (tokens == NULL || argv == NULL || out == NULL) {
+        error_handling("Error - failed allocating a supervised job");
+    }
+    size_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        tokens[i] = plan->arena + offset;
+        offset += strlen(tokens[i]) + 1;
+    }
+    int end = count > 0 && strcmp(tokens[count - 1], "&") == 0 ? count - 1 : count;
+    struct plan prefixes;
+    memset(&prefixes, 0, sizeof(prefixes));
+    int first = parse_job_prefixes(&prefixes, tokens, end);
+
+    int argc = 0;
+    argv[argc++] = strdup("myshell");
+    argv[argc++] = strdup("-c-instance");
+    if (job_placement.mem_nodes != 0) {
+        // Before @cpus, which narrows the CPUs of the nodes down to those the job had
+        cpu_set_t nodes;
+        CPU_ZERO(&nodes);
+        for (int node = 0; node < (int)(8 * sizeof(unsigned long)); node++) {
+            if (job_placement.mem_nodes & (1UL << node)) {
+                CPU_SET(node, &nodes);
+            }
+        }
+        argv[argc++] = format_id_list("@numa=", &nodes);
+    }
+    if (job_placement.pin_cpus) {
+        argv[argc++] = format_id_list("@cpus=", &job_placement.cpus);
+    }
+    format_limits(&job_limits, out);
+    fclose(out);
+    if (job_limits.set != 0) {
+        argv[argc++] = strdup("limit");
+        for (char *word = strtok(limits, " "); word != NULL; word = strtok(NULL, " ")) {
+            argv[argc++] = strdup(word);
+        }
+    }
+    free(limits);
+    for (int i = first; i < end; i++) {
+        argv[argc++] = strdup(tokens[i]);
+    }
+    argv[argc] = NULL;
+    free(tokens);
+    return argv;
+}
+
+// A set of CPU or node ids as prefix and a comma separated list, e.g. @cpus=0,2,5; malloc'd
+char *format_id_list(const char *prefix, const cpu_set_t *set) {
+    char *text = malloc(strlen(prefix) + 6 * CPU_SETSIZE + 1);
+    if (text == NULL) {
+        error_handling("Error - failed allocating a supervised job");
+    }
+    char *end = text + sprintf(text, "%s", prefix);
+    for (int id = 0; id < CPU_SETSIZE; id++) {
+        if (CPU_ISSET(id, set)) {
+            end += sprintf(end, end[-1] == '=' ? "%d" : ",%d", id);
+        }
+    }
+    return text;
+}
+
+// Helper function to set signal handling for child processes
+void set_child_signal_handling() {
+    if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
+        error_handling("Error - failed to update SIGINT signal handling for the child process");
+    }
+    if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+        error_handling("Error - failed to update SIGCHLD signal handling for the child process");
+    }
+}
+
+// Put a freshly forked process of the job being started into the job's process group. Both the child
+// (pid 0) and the parent call it, so the group exists whichever of them runs first; the first process
+// leads it. A foreground job under job control also gets the terminal, so Ctrl-C reaches all its stages.
+void enter_job_group(pid_t pid, int background) {
+    if (!job_own_group) {
+        return; // Without a terminal to hand over, foreground commands stay in the shell's process group
+    }
+    pid_t self = pid == 0 ? getpid() : pid;
+    if (job_pgid == 0) {
+        job_pgid = self;
+    }
+    // EACCES in the parent once the child has exec'd, its own call has placed it already
+    setpgid(self, job_pgid);
+    if (!background && job_control) {
+        tcsetpgrp(STDIN_FILENO, job_pgid);
+    }
+    if (pid == 0) {
+        job_control = 0; // Commands a builtin or function stage runs in this child are not jobs of the shell
+    }
+}
+
+// Wait for the processes of a foreground job in order, the last one's status is the job's. A job stopped
+// with Ctrl-Z becomes a stopped job its remaining processes are reaped with. The shell takes its terminal back.
+int wait_for_job(pid_t *pids, int count) {
+    int result = 1;
+    if (job_plan != NULL && job_plan->timeout_ns != 0) {
+        result = wait_for_timed_job(pids, count);
+        count = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        int status;
+        if (waitpid(pids[i], &status, job_control ? WUNTRACED : 0) == -1) {
+            if (errno != ECHILD && errno != EINTR) {
+                // Ignore ECHILD and EINTR in the parent shell after waitpid, as they are not considered errors
+                perror("Error - waitpid failed for a job");
+                result = 0;
+                break;
+            }
+        } else if (WIFSTOPPED(status)) {
+            pthread_mutex_lock(&jobs_lock);
+            starting_job = new_job(job_plan);
+            pthread_mutex_unlock(&jobs_lock);
+            flush_emitted_lines();
+            for (int j = i; j < count; j++) {
+                track_background_child(pids[j]);
+            }
+            pthread_mutex_lock(&jobs_lock);
+            if (starting_job != NULL) {
+                starting_job->pgid = job_pgid;
+                starting_job->stopped = 1;
+                if (job_cgroup_fd != -1) {
+                    starting_job->cgroup_fd = job_cgroup_fd;
+                    strcpy(starting_job->cgroup_name, job_cgroup_name);
+                    job_cgroup_fd = -1;
+                }
+                fprintf(stderr, "\n[%d] Stopped %s\n", starting_job->id, starting_job->command);
+            }
+            starting_job = NULL;
+            pthread_mutex_unlock(&jobs_lock);
+            last_status = 128 + WSTOPSIG(status);
+            break;
+        } else {
+            record_status(status);
+        }
+    }
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+    return result;
+}
+
+// Wait for a job under 'timeout' without a helper process: a timerfd is polled next to a pidfd per process.
+// On expiry the job's process group gets the signal, and SIGKILL once the -k grace has passed as well.
+int wait_for_timed_job(pid_t *pids, int count) {
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * (count + 1));
+    if (fds == NULL) {
+        error_handling("Error - failed allocating the timeout wait");
+        return 0;
+    }
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec deadline = { { 0, 0 }, { job_plan->timeout_ns / 1000000000, job_plan->timeout_ns % 1000000000 } };
+    if (timer == -1 || timerfd_settime(timer, 0, &deadline, NULL) == -1) {
+        error_handling("Error - failed arming the timeout");
+        return 0;
+    }
+    fds[0] = (struct pollfd){ timer, POLLIN, 0 };
+    int watched = 0;
+    for (int i = 0; i < count; i++) {
+        // A pidfd turns readable when its process exits; -2 marks one reaped below
+        fds[1 + i] = (struct pollfd){ (int)syscall(SYS_pidfd_open, pids[i], 0), POLLIN, 0 };
+        watched += fds[1 + i].fd >= 0;
+    }
+
+    int expirations = 0;
+    while (watched > 0) {
+        if (poll(fds, count + 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t ticks;
+            if (read(timer, &ticks, sizeof(ticks)) == -1) {
+                ticks = 0;
+            }
+            // Any process of the job still running names its group, the leader may be gone already
+            int target = -1;
+            for (int i = 0; i < count && target == -1; i++) {
+                target = fds[1 + i].fd >= 0 ? fds[1 + i].fd : -1;
+            }
+            signal_job(target, expirations == 0 ? job_plan->timeout_signal : SIGKILL);
+            expirations++;
+            if (expirations == 1 && job_plan->kill_after_ns != 0) {
+                deadline.it_value.tv_sec = job_plan->kill_after_ns / 1000000000;
+                deadline.it_value.tv_nsec = job_plan->kill_after_ns % 1000000000;
+                timerfd_settime(timer, 0, &deadline, NULL);
+            } else {
+                fds[0].fd = -1;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (fds[1 + i].fd >= 0 && fds[1 + i].revents != 0) {
+                int status;
+                if (waitpid(pids[i], &status, 0) != -1 && i == count - 1) {
+                    record_status(status);
+                }
+                close(fds[1 + i].fd);
+                fds[1 + i].fd = -2;
+                watched--;
+            }
+        }
+    }
+    // Processes without a pidfd are waited for normally, once the others are done
+    for (int i = 0; i < count; i++) {
+        int status;
+        if (fds[1 + i].fd != -2 && waitpid(pids[i], &status, 0) != -1 && i == count - 1) {
+            record_status(status);
+        }
+        if (fds[1 + i].fd >= 0) {
+            close(fds[1 + i].fd);
+        }
+    }
+    close(timer);
+    free(fds);
+
+    if (expirations > 0) {
+        last_status = expirations > 1 ? 128 + SIGKILL : TIMEOUT_STATUS;
+    }
+    return 1;
+}
+
+// Send a signal to the process group of the process behind a pidfd, falling back to killpg on kernels
+// without PIDFD_SIGNAL_PROCESS_GROUP. A stopped job is continued so it can act on the signal.
+void signal_job(int pidfd, int sig) {
+    if (pidfd < 0 || syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, PIDFD_SIGNAL_PROCESS_GROUP) == -1) {
+        killpg(job_pgid, sig);
+    }
+    if (sig != SIGKILL && sig != SIGCONT) {
+        killpg(job_pgid, SIGCONT);
+    }
+}
+
+// A slot in the jobs table for a new job: a free one, else one that has finished unreported. Under jobs_lock.
+struct job *new_job(const struct plan *plan) {
+    struct job *job = NULL;
+    for (int i = 0; i < MAX_JOBS && job == NULL; i++) {
+        if (jobs[i].id == 0) {
+            job = &jobs[i];
+        }
+    }
+    for (int i = 0; i < MAX_JOBS && job == NULL; i++) {
+        if (jobs[i].remaining == 0) {
+            job = &jobs[i];
+        }
+    }
+    if (job == NULL) {
+        return NULL; // Its processes are still reaped, it is just not listed
+    }
+    release_job_cgroup(job);
+    release_job_output(job);
+    memset(job, 0, sizeof(*job));
+    job->id = job - jobs + 1;
+    job->timer = -1;
+    job->created_ns = monotonic_ns();
+    if (plan != NULL) {
+        describe_plan(plan, job->command, sizeof(job->command));
+        job->timeout_ns = plan->timeout_ns;
+        job->kill_after_ns = plan->kill_after_ns;
+        job->timeout_signal = plan->timeout_signal;
+    }
+    return job;
+}
+
+// The job of a %n argument, NULL when there is none
+struct job *find_job(const char *spec) {
+    char *end;
+    long id = strtol(spec + 1, &end, 10);
+    if (spec[0] != '%' || end == spec + 1 || *end != '\0' || id < 1 || id > MAX_JOBS || jobs[id - 1].id == 0) {
+        return NULL;
+    }
+    return &jobs[id - 1];
+}
+
+// Report the background jobs that have finished since the last command, as an interactive shell does
+void report_finished_jobs(void) {
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].remaining == 0) {
+            fprintf(stderr, "[%d] Done %s\n", jobs[i].id, jobs[i].command);
+            jobs[i].id = 0;
+            release_job_cgroup(&jobs[i]);
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// A signal number from a number or a name, with or without its SIG prefix; -1 if there is no such signal
+int parse_signal(const char *name) {
+    char *end;
+    long number = strtol(name, &end, 10);
+    if (end != name && *end == '\0') {
+        return number >= 0 && number < NSIG ? (int)number : -1;
+    }
+    if (strncasecmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int sig = 1; sig < NSIG; sig++) {
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev != NULL && strcasecmp(abbrev, name) == 0) {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+// The command line a plan was built from, without the leading space format_plan writes
+void describe_plan(const struct plan *plan, char *buf, size_t size) {
+    char line[512];
+    line[0] = '\0';
+    FILE *out = fmemopen(line, sizeof(line) - 1, "w");
+    if (out != NULL) {
+        format_plan(plan, out);
+        fclose(out);
+    }
+    snprintf(buf, size, "%s", line + (line[0] == ' '));
+}
+
+// jobs [-l] - the background and stopped jobs, -l with their process groups; finished ones are listed once
+int builtin_jobs(int argc, char **argv, FILE *out) {
+    int with_pgid = argc > 1 && strcmp(argv[1], "-l") == 0;
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &jobs[i];
+        if (job->id == 0) {
+            continue;
+        }
+        const char *state = job->remaining == 0 ? "Done" : job->stopped ? "Stopped" :
+                            job->restart != RESTART_NONE && job->leader == 0 ? "Waiting" : "Running";
+        fprintf(out, "[%d] ", job->id);
+        if (with_pgid) {
+            fprintf(out, "%-7d ", (int)job->pgid);
+        }
+        fprintf(out, "%-8s %s", state, job->command);
+        if (job->restart != RESTART_NONE) {
+            fprintf(out, " (restarts: %d)", job->restarts);
+        }
+        fprintf(out, "\n");
+        if (job->remaining == 0) {
+            job->id = 0;
+            release_job_cgroup(job);
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return 0;
+}
+
+// kill [-SIGNAL | -s SIGNAL] %n|pid... - a %n target signals every process of the job at once with killpg
+int builtin_kill(int argc, char **argv, FILE *out) {
+    (void)out;
+    int sig = SIGTERM;
+    int i = 1;
+    if (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+        const char *name = argv[i] + 1;
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        }
+        if ((sig = parse_signal(name)) == -1) {
+            fprintf(stderr, "myshell: kill: %s: invalid signal\n", name);
+            return 2;
+        }
+        i++;
+    }
+    if (i == argc) {
+        fprintf(stderr, "usage: kill [-SIGNAL | -s SIGNAL] %%job|pid...\n");
+        return 2;
+    }
+
+    int status = 0;
+    for (; i < argc; i++) {
+        if (argv[i][0] == '%') {
+            pthread_mutex_lock(&jobs_lock);
+            struct job *job = find_job(argv[i]);
+            if (job != NULL && job->restart != RESTART_NONE && sig != SIGCONT && sig != SIGSTOP && sig != SIGTSTP) {
+                // Signalling a supervised job ends its supervision, whether it runs or waits to restart
+                job->stopping = 1;
+                if (job->leader == 0 && job->timer_action == TIMER_RESTART) {
+                    job->timer_action = TIMER_NONE;
+                    job_process_done(job);
+                    pthread_mutex_unlock(&jobs_lock);
+                    continue;
+                }
+            }
+            // SIGKILL through cgroup.kill takes the whole tree at once, descendants that left the group included
+            int killed = 0;
+            if (job != NULL && sig == SIGKILL && job->cgroup_name[0] != '\0') {
+                int fd = openat(job->cgroup_fd, "cgroup.kill", O_WRONLY | O_CLOEXEC);
+                killed = fd != -1 && write(fd, "1", 1) == 1;
+                if (fd != -1) {
+                    close(fd);
+                }
+            }
+            pthread_mutex_unlock(&jobs_lock);
+            if (killed) {
+                continue;
+            }
+            if (job == NULL || job->pgid == 0) {
+                fprintf(stderr, "myshell: kill: %s: no such job\n", argv[i]);
+                status = 1;
+                continue;
+            }
+            if (killpg(job->pgid, sig) == -1) {
+                fprintf(stderr, "myshell: kill: %s: %s\n", argv[i], strerror(errno));
+                status = 1;
+                continue;
+            }
+            if (sig == SIGCONT) {
+                job->stopped = 0;
+            } else if (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU) {
+                job->stopped = 1;
+            } else if (job->stopped && (sig == SIGTERM || sig == SIGHUP)) {
+                // A stopped job only acts on these once it runs again
+                killpg(job->pgid, SIGCONT);
+                job->stopped = 0;
+            }
+            continue;
+        }
+        char *end;
+        long pid = strtol(argv[i], &end, 10);
+        if (end == argv[i] || *end != '\0') {
+            fprintf(stderr, "myshell: kill: %s: arguments must be process or job IDs\n", argv[i]);
+            status = 1;
+        } else if (kill((pid_t)pid, sig) == -1) {
+            fprintf(stderr, "myshell: kill: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Whether jobs get cgroups: with set -o cgroups, or when MYSHELL_CGROUP_ROOT names a delegated cgroup v2
+// directory, and once the shell's session cgroup could be set up there
+int job_cgroups_active(void) {
+    if (cgroup_unavailable || (!option_cgroups && get_var("MYSHELL_CGROUP_ROOT") == NULL)) {
+        return 0;
+    }
+    return cgroup_session_fd != -1 || setup_cgroup_session();
+}
+
+// Create this shell's session cgroup, myshell-<pid>, under the delegated root. It holds no process of its own,
+// so it may hand the controllers it was given to the job cgroups below it.
+int setup_cgroup_session(void) {
+    char root[sizeof(cgroup_session_path) - 32];
+    if (!find_cgroup_root(root, sizeof(root))) {
+        fprintf(stderr, "myshell: no delegated cgroup v2 subtree, jobs run without cgroups\n");
+        cgroup_unavailable = 1;
+        return 0;
+    }
+    snprintf(cgroup_session_path, sizeof(cgroup_session_path), "%s/myshell-%d", root, (int)getpid());
+    if (mkdir(cgroup_session_path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "myshell: %s: %s, jobs run without cgroups\n", cgroup_session_path, strerror(errno));
+        cgroup_unavailable = 1;
+        return 0;
+    }
+    cgroup_session_fd = open(cgroup_session_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgroup_session_fd == -1) {
+        cgroup_unavailable = 1;
+        return 0;
+    }
+    // Enabled one by one, the root may have been given only some of them
+    char available[256];
+    if (read_cgroup_file(cgroup_session_fd, "cgroup.controllers", available, sizeof(available))) {
+        const char *wanted[] = { "cpu", "memory", "io" };
+        for (size_t i = 0; i < sizeof(wanted) / sizeof(wanted[0]); i++) {
+            char enable[16];
+            int len = snprintf(enable, sizeof(enable), "+%s", wanted[i]);
+            int fd = openat(cgroup_session_fd, "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+            if (strstr(available, wanted[i]) != NULL && fd != -1 && write(fd, enable, len) == -1) {
+                // Not delegated to us, the job cgroups still have cpu.stat
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+    return 1;
+}
+
+// The delegated root: MYSHELL_CGROUP_ROOT, else the shell's own cgroup on the cgroup2 mount if it may write there
+int find_cgroup_root(char *path, size_t size) {
+    const char *root = get_var("MYSHELL_CGROUP_ROOT");
+    if (root != NULL && root[0] != '\0') {
+        snprintf(path, size, "%s", root);
+        return access(path, W_OK) == 0;
+    }
+    char mount[4096] = "", line[4096];
+    FILE *in = fopen("/proc/self/mountinfo", "re");
+    while (in != NULL && mount[0] == '\0' && fgets(line, sizeof(line), in) != NULL) {
+        // ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS [OPTIONAL...] - FSTYPE SOURCE SUPER_OPTIONS
+        char *separator = strstr(line, " - cgroup2 ");
+        if (separator != NULL && sscanf(line, "%*s %*s %*s %*s %4095s", mount) != 1) {
+            mount[0] = '\0';
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    char own[4096] = "";
+    in = fopen("/proc/self/cgroup", "re");
+    while (in != NULL && own[0] == '\0' && fgets(line, sizeof(line), in) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            snprintf(own, sizeof(own), "%s", line + 3);
+            own[strcspn(own, "\n")] = '\0';
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (mount[0] == '\0' || own[0] == '\0') {
+        return 0;
+    }
+    snprintf(path, size, "%s%s", mount, strcmp(own, "/") == 0 ? "" : own);
+    return access(path, W_OK) == 0;
+}
+
+// A cgroup for the job being started, job-<n> in the session cgroup
+int create_job_cgroup(void) {
+    snprintf(job_cgroup_name, sizeof(job_cgroup_name), "job-%lu", ++cgroup_seq);
+    if (mkdirat(cgroup_session_fd, job_cgroup_name, 0755) == -1) {
+        return 0;
+    }
+    job_cgroup_fd = openat(cgroup_session_fd, job_cgroup_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job_cgroup_fd == -1) {
+        unlinkat(cgroup_session_fd, job_cgroup_name, AT_REMOVEDIR);
+        return 0;
+    }
+    return 1;
+}
+
+// Fork a process of the job being started, into the job's cgroup when it has one
+pid_t fork_into_job(const struct stage *stage) {
+    int will_exec = stage != NULL && stage->builtin == NULL && find_function(stage->argv[0]) == NULL;
+    pid_t pid = fork_own_child(job_cgroup_fd, will_exec);
+    if (pid == 0 && job_output_fds[0] != -1) {
+        // The caller applies the stage's pipes and redirections next, they take precedence over these
+        dup2(job_output_fds[0], STDOUT_FILENO);
+        dup2(job_output_fds[1], STDERR_FILENO);
+        job_output_fds[0] = job_output_fds[1] = -1;
+    }
+    return pid;
+}
+
+// A child that is going to exec is created straight in the cgroup by clone3(CLONE_INTO_CGROUP), so none of
+// its time is charged elsewhere. Unlike glibc's fork, the raw syscall leaves the locks other threads held
+// at that moment held in the child. fork_own_child uses it under jobs_lock, outside of which the monitor
+// thread neither allocates nor touches stdio; spawn_instance's child makes async-signal-safe calls only. A
+// child that keeps running shell code (a builtin, a function, a relay) is forked by glibc and moves itself
+// first thing.
+pid_t fork_into_cgroup(int cgroup_fd, int will_exec) {
+    pid_t pid;
+    if (cgroup_fd == -1) {
+        pid = fork();
+    } else if (will_exec) {
+        struct clone3_args args = { 0 };
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgroup_fd;
+        pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid == -1 && errno != EAGAIN && errno != ENOMEM) {
+            return fork_into_cgroup(cgroup_fd, 0);
+        }
+    } else {
+        pid = fork();
+        if (pid == 0) {
+            int fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+            if (fd != -1 && write(fd, "0", 1) == -1) {
+                // Left in the shell's cgroup, the job's accounting misses this process
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+    if (pid == 0) {
+        // Anything this child starts belongs to the job's cgroup already
+        cgroup_unavailable = 1;
+        // The monitor may have been writing job lines, those queued are the shell's to write
+        pthread_mutex_init(&emit_lock, NULL);
+        emitted_lines[0].len = emitted_lines[1].len = 0;
+        flushing_lines[0].len = flushing_lines[1].len = 0;
+    }
+    return pid;
+}
+
+// cpu.stat, memory.peak and io.stat of a cgroup; the files a controller that is not enabled would provide
+// are missing and read as 0
+void read_cgroup_stats(int cgroup_fd, struct cgroup_stats *stats) {
+    char buf[4096];
+    memset(stats, 0, sizeof(*stats));
+    if (!read_cgroup_file(cgroup_fd, "cpu.stat", buf, sizeof(buf))) {
+        return;
+    }
+    stats->valid = 1;
+    stats->usage_usec = cgroup_value(buf, "usage_usec");
+    stats->user_usec = cgroup_value(buf, "user_usec");
+    stats->system_usec = cgroup_value(buf, "system_usec");
+    if (read_cgroup_file(cgroup_fd, "memory.peak", buf, sizeof(buf))) {
+        stats->memory_peak = strtoull(buf, NULL, 10);
+    }
+    // One line per device: MAJ:MIN rbytes=N wbytes=N rios=N ...
+    if (read_cgroup_file(cgroup_fd, "io.stat", buf, sizeof(buf))) {
+        for (char *p = buf; (p = strstr(p, "bytes=")) != NULL; p += 6) {
+            uint64_t n = strtoull(p + 6, NULL, 10);
+            if (p > buf && p[-1] == 'r') {
+                stats->read_bytes += n;
+            } else if (p > buf && p[-1] == 'w') {
+                stats->write_bytes += n;
+            }
+        }
+    }
+}
+
+// Read a small cgroup file into buf as a string, 0 if it does not exist
+int read_cgroup_file(int cgroup_fd, const char *name, char *buf, size_t size) {
+    int fd = openat(cgroup_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    return 1;
+}
+
+// The value of a "key value" line of a flat keyed cgroup file
+uint64_t cgroup_value(const char *text, const char *key) {
+    size_t len = strlen(key);
+    for (const char *line = text; line != NULL && *line != '\0'; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+            return strtoull(line + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+// Remove a finished job's cgroup when its slot is reused or forgotten; one still populated is left behind
+void release_job_cgroup(struct job *job) {
+    if (job->cgroup_name[0] != '\0') {
+        unlinkat(cgroup_session_fd, job->cgroup_name, AT_REMOVEDIR);
+        close(job->cgroup_fd);
+        job->cgroup_name[0] = '\0';
+    }
+}
+
+// On exit: the job cgroups that are empty by now, and the session cgroup if nothing is left in it
+void remove_cgroup_session(void) {
+    if (cgroup_session_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        release_job_cgroup(&jobs[i]);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    close(cgroup_session_fd);
+    cgroup_session_fd = -1;
+    rmdir(cgroup_session_path);
+}
+
+// One line of accounting: CPU time, memory peak and I/O bytes
+void format_cgroup_stats(const struct cgroup_stats *stats, FILE *out) {
+    char peak[16], read_bytes[16], write_bytes[16];
+    fprintf(out, "cpu %8.3fs user %8.3fs sys %8.3fs  peak %7s  read %7s  written %7s",
+            stats->usage_usec / 1e6, stats->user_usec / 1e6, stats->system_usec / 1e6,
+            stats->memory_peak ? human_size(stats->memory_peak, peak, sizeof(peak)) : "-",
+            human_size(stats->read_bytes, read_bytes, sizeof(read_bytes)),
+            human_size(stats->write_bytes, write_bytes, sizeof(write_bytes)));
+}
+
+// 1536 -> "1.5K"
+const char *human_size(uint64_t bytes, char *buf, size_t size) {
+    const char *units = "BKMGTP";
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 5) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(buf, size, unit == 0 ? "%.0f%c" : "%.1f%c", value, units[unit]);
+    return buf;
+}
+
+// jobstat - cgroup accounting of the jobs, live for running ones, and of the last foreground job
+int builtin_jobstat(int argc, char **argv, FILE *out) {
+    (void)argc;
+    (void)argv;
+    if (last_job_stats.valid) {
+        fprintf(out, "[fg] %-8s ", "Done");
+        format_cgroup_stats(&last_job_stats, out);
+        fprintf(out, "  %s\n", last_job_command);
+    }
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job *job = &jobs[i];
+        if (job->id == 0 || (job->cgroup_name[0] == '\0' && !job->stats.valid && !job->usage.valid)) {
+            continue;
+        }
+        // Without a cgroup, the rusage of the processes reaped so far
+        struct cgroup_stats live;
+        const struct cgroup_stats *stats = job->stats.valid || job->cgroup_name[0] != '\0' ? &job->stats : &job->usage;
+        if (job->remaining > 0) {
+            read_cgroup_stats(job->cgroup_fd, &live);
+            stats = &live;
+        } else if (job->cgroup_name[0] != '\0') {
+            // Descendants that escaped the job's process group kept its cgroup, they may be gone by now
+            read_cgroup_stats(job->cgroup_fd, &job->stats);
+            if (unlinkat(cgroup_session_fd, job->cgroup_name, AT_REMOVEDIR) == 0) {
+                close(job->cgroup_fd);
+                job->cgroup_name[0] = '\0';
+            }
+        }
+        fprintf(out, "[%d]  %-8s ", job->id, job->remaining > 0 ? "Running" :
+                job->cgroup_name[0] != '\0' ? "Orphans" : "Done");
+        format_cgroup_stats(stats, out);
+        fprintf(out, "  %s\n", job->command);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return 0;
+}
+
+// Create the pipes of the background job being started. Its processes write to them instead of the shell's
+// stdout and stderr: fork_into_job puts job_output_fds in place in each one, a supervised job keeps the
+// write ends for every instance it starts. Under jobs_lock.
+void open_job_output(struct job *job, int supervised) {
+    int fds[2][2];
+    int streams = option_jobpipes ? 2 : 1;
+    for (int stream = 0; stream < streams; stream++) {
+        if (pipe2(fds[stream], O_CLOEXEC) == -1) {
+            while (stream-- > 0) {
+                close(fds[stream][0]);
+                close(fds[stream][1]);
+            }
+            return;
+        }
+    }
+    job->log_fd = option_joblog ? memfd_create("joblog", MFD_CLOEXEC) : -1;
+    job->has_log = job->log_fd != -1;
+    job->log_head = 0;
+    if (!job->has_log && !option_jobpipes) {
+        // Nowhere to keep the output, the job writes where the shell does
+        close(fds[0][0]);
+        close(fds[0][1]);
+        return;
+    }
+    for (int stream = 0; stream < 2 && option_jobpipes; stream++) {
+        if (job_line_fds[stream] == -1) {
+            job_line_fds[stream] = fcntl(STDOUT_FILENO + stream, F_DUPFD_CLOEXEC, 3);
+        }
+    }
+    for (int stream = 0; stream < streams; stream++) {
+        fcntl(fds[stream][0], F_SETFL, O_NONBLOCK);
+        job->output[stream] = fds[stream][0];
+        job->output_write[stream] = fds[stream][1];
+    }
+    job->output_streams = streams;
+    job->holds_output_write = supervised;
+    if (!supervised) {
+        job_output_fds[0] = fds[0][1];
+        job_output_fds[1] = fds[streams - 1][1];
+    }
+}
+
+// The job's processes are forked: drop the write ends the shell held for them, unless the job is supervised,
+// and hand the read ends to the monitor. Under jobs_lock.
+void hand_over_job_output(struct job *job) {
+    job_output_fds[0] = job_output_fds[1] = -1;
+    for (int stream = 0; stream < job->output_streams; stream++) {
+        if (job->restart == RESTART_NONE) {
+            close(job->output_write[stream]);
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = MONITOR_OUTPUT + 2 * (job - jobs) + stream };
+        // The monitor runs once the job has a watched process; without one there is nothing to drain
+        if (monitor_epfd == -1 || (option_jobpipes && (job->partial[stream] = malloc(JOB_LINE_MAX)) == NULL)) {
+            close(job->output[stream]);
+            continue;
+        }
+        job->partial_len[stream] = 0;
+        job->output_open |= 1 << stream;
+        epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, job->output[stream], &ev);
+    }
+}
+
+// Take what a job wrote to one of its pipes: with jobpipes read it to emit the complete lines; with joblog
+// alone splice it into the log. At EOF close the pipe. Under jobs_lock.
+void drain_job_output(struct job *job, int stream) {
+    char buf[65536];
+    ssize_t n;
+    if (!(job->output_open & (1 << stream))) {
+        return;
+    }
+    if (job->partial[stream] != NULL) {
+        n = read(job->output[stream], buf, sizeof(buf));
+        if (n > 0) {
+            emit_job_lines(job, stream, buf, n);
+        }
+    } else {
+        n = splice_job_log(job, stream);
+    }
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        close_job_output(job, stream);
+    }
+}
+
+// Move what is in the job's pipe into the log ring, up to its end; the page cache of the memfd is the only
+// copy it makes
+ssize_t splice_job_log(struct job *job, int stream) {
+    loff_t offset = job->log_head % JOB_LOG_SIZE;
+    ssize_t n = splice(job->output[stream], NULL, job->log_fd, &offset, JOB_LOG_SIZE - offset,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        job->log_head += n;
+    }
+    return n;
+}
+
+// Add output the shell already read to the log ring, wrapping at its end
+void append_job_log(struct job *job, const char *data, size_t len) {
+    while (job->has_log && len > 0) {
+        size_t offset = job->log_head % JOB_LOG_SIZE;
+        size_t chunk = len < JOB_LOG_SIZE - offset ? len : JOB_LOG_SIZE - offset;
+        ssize_t n = pwrite(job->log_fd, data, chunk, offset);
+        if (n <= 0) {
+            return;
+        }
+        job->log_head += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Queue every complete line of data, each behind a [n] prefix, for flush_emitted_lines; keep the incomplete
+// last line for the next read. Under jobs_lock.
+void emit_job_lines(struct job *job, int stream, const char *data, size_t len) {
+    char prefix[16];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "[%d] ", job->id);
+    const char *end = data + len;
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        size_t take = newline != NULL ? (size_t)(newline + 1 - data) : 0;
+        if (newline == NULL) {
+            size_t rest = end - data;
+            if (job->partial_len[stream] + rest <= JOB_LINE_MAX) {
+                memcpy(job->partial[stream] + job->partial_len[stream], data, rest);
+                job->partial_len[stream] += rest;
+                break;
+            }
+            // Too long to hold, what there is room for goes out as a line of its own
+            take = JOB_LINE_MAX - job->partial_len[stream];
+        }
+        // With joblog the log gets the same whole lines, unprefixed
+        queue_emitted(stream, prefix, prefix_len);
+        if (job->partial_len[stream] > 0) {
+            queue_emitted(stream, job->partial[stream], job->partial_len[stream]);
+            append_job_log(job, job->partial[stream], job->partial_len[stream]);
+            job->partial_len[stream] = 0;
+        }
+        if (take > 0) {
+            queue_emitted(stream, data, take);
+            append_job_log(job, data, take);
+        }
+        if (newline == NULL) {
+            queue_emitted(stream, "\n", 1);
+            append_job_log(job, "\n", 1);
+        }
+        data += take;
+    }
+}
+
+void queue_emitted(int stream, const void *data, size_t len) {
+    struct emitted_lines *lines = &emitted_lines[stream];
+    if (lines->len + len > lines->capacity) {
+        lines->capacity = lines->len + len > 2 * lines->capacity ? lines->len + len : 2 * lines->capacity;
+        lines->data = realloc(lines->data, lines->capacity);
+        if (lines->data == NULL) {
+            error_handling("Error - failed allocating job output");
+        }
+    }
+    memcpy(lines->data + lines->len, data, len);
+    lines->len += len;
+}
+
+// Write the queued job lines where the shell's own output goes, with jobs_lock dropped. The buffers only
+// change hands under it, nothing is allocated or freed outside it: a clone3 child forked meanwhile must not
+// inherit a held malloc lock.
+void flush_emitted_lines(void) {
+    pthread_mutex_lock(&emit_lock);
+    for (int stream = 0; stream < 2; stream++) {
+        pthread_mutex_lock(&jobs_lock);
+        struct emitted_lines lines = flushing_lines[stream];
+        flushing_lines[stream] = emitted_lines[stream];
+        emitted_lines[stream] = lines;
+        pthread_mutex_unlock(&jobs_lock);
+        struct iovec iov = { flushing_lines[stream].data, flushing_lines[stream].len };
+        if (iov.iov_len > 0) {
+            write_lines(job_line_fds[stream], &iov, 1);
+        }
+        flushing_lines[stream].len = 0;
+    }
+    pthread_mutex_unlock(&emit_lock);
+}
+
+// writev all of them, after a short write as well
+void write_lines(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; // Nowhere to write the job's output to any more
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// The job's stream reached EOF or is dropped: its unterminated last line goes out with a newline
+void close_job_output(struct job *job, int stream) {
+    if (job->partial_len[stream] > 0) {
+        emit_job_lines(job, stream, "\n", 1);
+    }
+    epoll_ctl(monitor_epfd, EPOLL_CTL_DEL, job->output[stream], NULL);
+    close(job->output[stream]);
+    free(job->partial[stream]);
+    job->partial[stream] = NULL;
+    job->output_open &= ~(1 << stream);
+}
+
+// Before a job slot is reused: take what is still in its pipes, close them and drop its log. Under jobs_lock.
+void release_job_output(struct job *job) {
+    for (int stream = 0; stream < 2; stream++) {
+        drain_job_output(job, stream);
+        if (job->output_open & (1 << stream)) {
+            close_job_output(job, stream);
+        }
+    }
+    if (job->holds_output_write) {
+        for (int stream = 0; stream < job->output_streams; stream++) {
+            close(job->output_write[stream]);
+        }
+        job->holds_output_write = 0;
+    }
+    if (job->has_log) {
+        close(job->log_fd);
+        job->has_log = 0;
+    }
+}
+
+// joblog %n... - the output of a background job started with set -o joblog, its last JOB_LOG_SIZE bytes.
+// The log of a finished job is kept until its number is reused.
+int builtin_joblog(int argc, char **argv, FILE *out) {
+    int status = 0;
+    if (argc < 2) {
+        fprintf(stderr, "usage: joblog %%n...\n");
+        return 2;
+    }
+    for (int i = 1; i < argc; i++) {
+        char *end;
+        long id = argv[i][0] == '%' ? strtol(argv[i] + 1, &end, 10) : 0;
+        int log_fd = -1;
+        uint64_t head = 0;
+        pthread_mutex_lock(&jobs_lock);
+        if (id >= 1 && id <= MAX_JOBS && *end == '\0' && jobs[id - 1].has_log) {
+            // Its own descriptor, the slot may be reused while the log is copied
+            log_fd = fcntl(jobs[id - 1].log_fd, F_DUPFD_CLOEXEC, 3);
+            head = jobs[id - 1].log_head;
+        }
+        pthread_mutex_unlock(&jobs_lock);
+        if (log_fd == -1) {
+            fprintf(stderr, "myshell: joblog: %s: no such job log\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        fflush(out);
+        if (head <= JOB_LOG_SIZE) {
+            copy_job_log(log_fd, 0, head, out);
+        } else {
+            // The ring wrapped: the oldest byte is at the write position, and the line it is in lost its start
+            off_t start = head % JOB_LOG_SIZE;
+            char buf[4096];
+            ssize_t n = pread(log_fd, buf, sizeof(buf) < (size_t)(JOB_LOG_SIZE - start) ? sizeof(buf) :
+                              (size_t)(JOB_LOG_SIZE - start), start);
+            char *newline = n > 0 ? memchr(buf, '\n', n) : NULL;
+            if (newline != NULL) {
+                start += newline + 1 - buf;
+            }
+            copy_job_log(log_fd, start, JOB_LOG_SIZE - start, out);
+            copy_job_log(log_fd, 0, head % JOB_LOG_SIZE, out);
+        }
+        close(log_fd);
+    }
+    return status;
+}
+
+// Copy part of a log to out, with sendfile when out is a plain descriptor's stream
+int copy_job_log(int log_fd, off_t offset, size_t len, FILE *out) {
+    while (len > 0) {
+        ssize_t n = sendfile(fileno(out), log_fd, &offset, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len -= n;
+    }
+    // Not a descriptor sendfile writes to, or one that failed: through the stream
+    char buf[65536];
+    while (len > 0) {
+        ssize_t n = pread(log_fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if (n <= 0 || fwrite(buf, 1, n, out) != (size_t)n) {
+            return 0;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// jtop [-d SECONDS] [-n FRAMES] - CPU, memory, I/O, state and runtime of the background jobs, every SECONDS
+// (1 by default). On a terminal it runs until Enter is pressed, otherwise it shows one frame unless -n says
+// more. Each frame is a pread of three /proc files per process, all opened once, so it costs next to nothing.
+int builtin_jtop(int argc, char **argv, FILE *out) {
+    uint64_t interval = 1000000000ULL;
+    long frames = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && parse_duration(argv[i + 1], &interval) && interval > 0) {
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && (frames = atol(argv[i + 1])) > 0) {
+            i++;
+        } else {
+            fprintf(stderr, "usage: jtop [-d SECONDS] [-n FRAMES]\n");
+            return 2;
+        }
+    }
+    int interactive = frames == 0 && isatty(STDIN_FILENO);
+    if (frames == 0) {
+        frames = 1;
+    }
+    struct jtop_proc *procs = calloc(MAX_JTOP_PROCS, sizeof(struct jtop_proc));
+    if (procs == NULL) {
+        error_handling("Error - failed allocating the jtop process table");
+        return 1;
+    }
+    int count = collect_jtop_procs(procs, 0);
+    uint64_t previous = monotonic_ns();
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (long frame = 0; interactive || frame < frames; frame++) {
+        // Sleep out the interval, or until Enter ends an interactive jtop
+        struct pollfd input = { .fd = interactive ? STDIN_FILENO : -1, .events = POLLIN };
+        if (poll(&input, 1, interval / 1000000) > 0) {
+            char line[256];
+            if (read(STDIN_FILENO, line, sizeof(line)) >= 0) {
+                break;
+            }
+        }
+        count = collect_jtop_procs(procs, count);
+        uint64_t now = monotonic_ns();
+        double elapsed = (now - previous) / 1e9;
+        previous = now;
+
+        if (isatty(fileno(out))) {
+            fprintf(out, "\033[H\033[J");
+        } else if (frame > 0) {
+            fprintf(out, "\n");
+        }
+        fprintf(out, "%-5s %7s %1s %6s %7s %8s %8s %9s  %s\n", "JOB", "PGID", "S", "CPU%", "RSS", "READ/s",
+                "WRITE/s", "TIME", "COMMAND");
+        pthread_mutex_lock(&jobs_lock);
+        for (int j = 0; j < MAX_JOBS; j++) {
+            struct job *job = &jobs[j];
+            if (job->id == 0 || job->remaining == 0) {
+                continue;
+            }
+            // A job is as busy as its busiest process: running, in disk sleep, sleeping, stopped, a zombie
+            const char *busiest = "RDSTtZ";
+            char state = '-';
+            uint64_t ticks = 0, rss = 0, rchar = 0, wchar = 0;
+            for (int p = 0; p < count; p++) {
+                char proc_state;
+                uint64_t proc_ticks, proc_rss, proc_rchar, proc_wchar;
+                if (procs[p].job_id != job->id ||
+                    !sample_jtop_proc(&procs[p], &proc_state, &proc_ticks, &proc_rss, &proc_rchar, &proc_wchar)) {
+                    continue;
+                }
+                ticks += proc_ticks - procs[p].ticks;
+                rchar += proc_rchar - procs[p].rchar;
+                wchar += proc_wchar - procs[p].wchar;
+                rss += proc_rss * page_size;
+                procs[p].ticks = proc_ticks;
+                procs[p].rchar = proc_rchar;
+                procs[p].wchar = proc_wchar;
+                if (strchr(busiest, proc_state) == NULL) {
+                    proc_state = 'S'; // Idle and the like
+                }
+                if (state == '-' || strchr(busiest, proc_state) < strchr(busiest, state)) {
+                    state = proc_state;
+                }
+            }
+            if (state == '-' && job->restart != RESTART_NONE && job->leader == 0) {
+                state = 'W'; // A supervised job between two instances
+            }
+            char rss_text[16], read_text[16], write_text[16], runtime[16];
+            format_runtime(now - job->created_ns, runtime, sizeof(runtime));
+            fprintf(out, "[%d]%*s %7d %c %6.1f %7s %8s %8s %9s  %s\n", job->id, job->id < 10 ? 2 : 1, "",
+                    (int)job->pgid, state, elapsed > 0 ? 100.0 * ticks / ticks_per_second / elapsed : 0.0,
+                    human_size(rss, rss_text, sizeof(rss_text)),
+                    human_size(elapsed > 0 ? rchar / elapsed : 0, read_text, sizeof(read_text)),
+                    human_size(elapsed > 0 ? wchar / elapsed : 0, write_text, sizeof(write_text)),
+                    runtime, job->command);
+        }
+        pthread_mutex_unlock(&jobs_lock);
+        fflush(out);
+    }
+    for (int p = 0; p < count; p++) {
+        close(procs[p].stat_fd);
+        close(procs[p].statm_fd);
+        close(procs[p].io_fd);
+    }
+    free(procs);
+    return 0;
+}
+
+// Bring jtop's process table up to date with the jobs. Every process of a job, descendants included, is
+// listed again each interval: from its cgroup.procs when it has a cgroup, otherwise by its process group,
+// and from the monitor's watches for a child that left the group. Returns the new count.
+int collect_jtop_procs(struct jtop_proc *procs, int count) {
+    for (int p = 0; p < count; p++) {
+        procs[p].seen = 0;
+    }
+    // Jobs without a cgroup are matched in one pass over /proc, made after the lock is dropped
+    pid_t pgids[MAX_JOBS];
+    int pgid_jobs[MAX_JOBS];
+    int num_pgids = 0;
+    pthread_mutex_lock(&jobs_lock);
+    for (int j = 0; j < MAX_JOBS; j++) {
+        struct job *job = &jobs[j];
+        if (job->id == 0 || job->remaining == 0) {
+            continue;
+        }
+        if (job->cgroup_name[0] != '\0') {
+            int fd = openat(job->cgroup_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+            FILE *in = fd != -1 ? fdopen(fd, "r") : NULL;
+            int pid;
+            while (in != NULL && fscanf(in, "%d", &pid) == 1) {
+                count = track_jtop_proc(procs, count, pid, job->id);
+            }
+            if (in != NULL) {
+                fclose(in);
+            } else if (fd != -1) {
+                close(fd);
+            }
+        } else if (job->pgid > 0 && !(job->restart != RESTART_NONE && job->leader == 0)) {
+            pgids[num_pgids] = job->pgid;
+            pgid_jobs[num_pgids++] = job->id;
+        }
+    }
+    for (int i = 0; i < MAX_BACKGROUND_CHILDREN; i++) {
+        struct child_watch *watch = &child_watches[i];
+        if (watch->pid != 0 && watch->job != NULL) {
+            count = track_jtop_proc(procs, count, watch->pid, watch->job->id);
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    DIR *all = num_pgids > 0 ? opendir("/proc") : NULL;
+    struct dirent *entry;
+    while (all != NULL && (entry = readdir(all)) != NULL) {
+        char path[300], buf[512];
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd != -1 ? read(fd, buf, sizeof(buf) - 1) : -1;
+        if (fd != -1) {
+            close(fd);
+        }
+        if (n <= 0) {
+            continue;
+        }
+        buf[n] = '\0';
+        // pid (comm) state ppid pgrp, the fields after comm start past its last ')'
+        char *fields = strrchr(buf, ')');
+        int pgrp;
+        if (fields == NULL || sscanf(fields + 2, "%*c %*d %d", &pgrp) != 1) {
+            continue;
+        }
+        for (int k = 0; k < num_pgids; k++) {
+            if (pgrp == pgids[k]) {
+                count = track_jtop_proc(procs, count, atoi(entry->d_name), pgid_jobs[k]);
+            }
+        }
+    }
+    if (all != NULL) {
+        closedir(all);
+    }
+
+    int kept = 0;
+    for (int p = 0; p < count; p++) {
+        if (procs[p].seen) {
+            procs[kept++] = procs[p];
+        } else {
+            close(procs[p].stat_fd);
+            close(procs[p].statm_fd);
+            close(procs[p].io_fd);
+        }
+    }
+    return kept;
+}
+
+// Mark a process of a job as still there. One not in the table yet gets its /proc files opened and a first
+// sample taken, so its first interval is not charged with its whole past. Returns the new count.
+int track_jtop_proc(struct jtop_proc *procs, int count, pid_t pid, int job_id) {
+    int p = 0;
+    while (p < count && procs[p].pid != pid) {
+        p++;
+    }
+    if (p == count) {
+        if (count == MAX_JTOP_PROCS) {
+            return count;
+        }
+        char path[64];
+        struct jtop_proc *proc = &procs[count];
+        proc->pid = pid;
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        proc->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+        proc->statm_fd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+        proc->io_fd = open(path, O_RDONLY | O_CLOEXEC);
+        char state;
+        uint64_t rss;
+        if (proc->stat_fd == -1 || !sample_jtop_proc(proc, &state, &proc->ticks, &rss, &proc->rchar, &proc->wchar)) {
+            close(proc->stat_fd);
+            close(proc->statm_fd);
+            close(proc->io_fd);
+            return count;
+        }
+        count++;
+    }
+    procs[p].job_id = job_id;
+    procs[p].seen = 1;
+    return count;
+}
+
+// Read a process's state, CPU ticks, resident pages and I/O counters through its open /proc files.
+// Returns 0 once the process is gone. /proc/<pid>/io is optional: it needs ptrace access to the process.
+int sample_jtop_proc(struct jtop_proc *proc, char *state, uint64_t *ticks, uint64_t *rss, uint64_t *rchar, uint64_t *wchar) {
+    char buf[1024];
+    ssize_t n = pread(proc->stat_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    // pid (comm) state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime; comm
+    // may hold spaces and parentheses, the fields after it start past its last ')'
+    char *fields = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    if (fields == NULL || sscanf(fields + 2, "%c %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu %llu",
+                                 state, &utime, &stime) != 3) {
+        return 0;
+    }
+    *ticks = utime + stime;
+    unsigned long long size, resident = 0;
+    n = pread(proc->statm_fd, buf, sizeof(buf) - 1, 0);
+    if (n > 0) {
+        buf[n] = '\0';
+        sscanf(buf, "%llu %llu", &size, &resident);
+    }
+    *rss = resident;
+    *rchar = 0;
+    *wchar = 0;
+    n = pread(proc->io_fd, buf, sizeof(buf) - 1, 0);
+    if (n > 0) {
+        buf[n] = '\0';
+        char *field = strstr(buf, "rchar: ");
+        *rchar = field != NULL ? strtoull(field + 7, NULL, 10) : 0;
+        field = strstr(buf, "wchar: ");
+        *wchar = field != NULL ? strtoull(field + 7, NULL, 10) : 0;
+    }
+    return 1;
+}
+
+// 3725s -> "1:02:05", 65s -> "1:05"
+void format_runtime(uint64_t ns, char *buf, size_t size) {
+    uint64_t seconds = ns / 1000000000ULL;
+    if (seconds >= 3600) {
+        snprintf(buf, size, "%llu:%02llu:%02llu", (unsigned long long)(seconds / 3600),
+                 (unsigned long long)(seconds / 60 % 60), (unsigned long long)(seconds % 60));
+    } else {
+        snprintf(buf, size, "%llu:%02llu", (unsigned long long)(seconds / 60), (unsigned long long)(seconds % 60));
+    }
+}
+
+// Helper function to redirect stdout to a pipe
+void redirect_stdout_to_pipe(int pipefd_write) {
+    if (dup2(pipefd_write, STDOUT_FILENO) == -1) {
+        error_handling("Error - failed to redirect stdout to the pipe");
+    }
+    close(pipefd_write);  // Close the pipe write end after redirection
+}
+
+// Helper function to redirect stdin from a pipe
+void redirect_stdin_from_pipe(int pipefd_read) {
+    if (dup2(pipefd_read, STDIN_FILENO) == -1) {
+        error_handling("Error - failed to redirect stdin from the pipe");
+    }
+    close(pipefd_read);  // Close the pipe read end after redirection
+}
+
+int establish_pipe(struct plan *plan) {
+    // Execute commands with piping, one child per stage, each stage reading the previous stage's pipe.
+    // With a fan-out the stages before it form the pipeline, and a relay feeds its output to the branches.
+    int num_stages = plan->num_stages;
+    int num_linear = plan->fanout ? plan->fanout : num_stages;
+    int num_pids = plan->fanout ? num_stages + 1 : num_stages;
+    pid_t *pids = malloc(sizeof(pid_t) * num_pids);
+    if (pids == NULL) {
+        error_handling("Error - failed allocating the pipeline");
+        return 0;
+    }
+
+    // Read end of the previous stage's pipe; the parent keeps at most one open so no child inherits a stray write end
+    int prev_read = -1;
+
+    for (int i = 0; i < num_linear; i++) {
+        int pipefd[2] = { -1, -1 };
+        int is_last = (i == num_stages - 1);
+
+        // Set up the pipe towards the next stage
+        if (!is_last && pipe(pipefd) == -1) {
+            error_handling("Error - failed piping");
+            return 0;
+        }
+
+        pids[i] = fork_into_job(&plan->stages[i]);
+        if (pids[i] == -1) {
+            // Fork failed
+            error_handling("Error - failed forking");
+            return 0;
+        }
+
+        if (pids[i] == 0) {
+            is_child_process = 1;
+            enter_job_group(0, plan->background);
+            // Stage child process; a background pipeline keeps ignoring SIGINT like any background command
+            if (!plan->background) {
+                set_child_signal_handling();  // Set signal handling for the child
+            }
+
+            if (prev_read != -1) {
+                redirect_stdin_from_pipe(prev_read);  // Redirect stdin from the previous pipe
+            }
+            if (!is_last) {
+                close(pipefd[0]);  // Close unused read end of the pipe
+                redirect_stdout_to_pipe(pipefd[1]);  // Redirect stdout to the pipe
+            }
+
+            // Execute the stage's command, explicit redirections override the pipe ends
+            execute_child(&plan->stages[i]);
+            _exit(EXIT_FAILURE);
+        }
+
+        // Parent process: drop the ends now owned by the children
+        enter_job_group(pids[i], plan->background);
+        if (plan->background) {
+            track_background_child(pids[i]);
+        }
+        if (prev_read != -1) {
+            close(prev_read);
+        }
+        if (!is_last) {
+            close(pipefd[1]);
+            prev_read = pipefd[0];
+        }
+    }
+
+    if (plan->fanout && !start_fanout(plan, prev_read, pids + num_linear)) {
+        free(pids);
+        return 0;
+    }
+
+    if (plan->background) {
+        last_status = 0;
+    }
+
+    // Wait for every stage of a foreground pipeline, the last stage's status is the pipeline's
+    int result = plan->background ? 1 : wait_for_job(pids, num_pids);
+    free(pids);
+    return result; // 1 when there was no error in the parent, allowing the shell to handle another command
+}
+
+// A pipeline with a splice relay on every link: stage i writes into its own pipe, the relay moves the data
+// into the pipe stage i + 1 reads, and records how much went through and how long each side waited
+int establish_relayed_pipe(struct plan *plan) {
+    int num_stages = plan->num_stages;
+    int num_links = num_stages - 1;
+    if (num_links > MAX_PIPESTAT_LINKS) {
+        return establish_pipe(plan);
+    }
+    int upstream[MAX_PIPESTAT_LINKS][2], downstream[MAX_PIPESTAT_LINKS][2];
+    pid_t pids[MAX_PIPESTAT_LINKS + 2];
+    for (int i = 0; i < num_links; i++) {
+        if (pipe2(upstream[i], O_CLOEXEC) == -1 || pipe2(downstream[i], O_CLOEXEC) == -1) {
+            error_handling("Error - failed piping");
+            return 0;
+        }
+    }
+    struct pipeline_stat *stat = claim_pipeline_stat(plan);
+
+    // The relay is pids[0] and is waited on first, so the last stage's status is the pipeline's
+    for (int p = 0; p <= num_stages; p++) {
+        pids[p] = fork_into_job(p == 0 ? NULL : &plan->stages[p - 1]);
+        if (pids[p] == -1) {
+            error_handling("Error - failed forking");
+            return 0;
+        }
+        if (pids[p] == 0) {
+            is_child_process = 1;
+            enter_job_group(0, plan->background);
+            if (!plan->background) {
+                set_child_signal_handling();
+            }
+            int stage = p - 1;
+            // Keep only this process's own ends, a builtin or function stage never execs to drop the rest
+            for (int i = 0; i < num_links; i++) {
+                if (p == 0) {
+                    close(upstream[i][1]);
+                    close(downstream[i][0]);
+                    continue;
+                }
+                if (i == stage) {
+                    redirect_stdout_to_pipe(upstream[i][1]);
+                } else {
+                    close(upstream[i][1]);
+                }
+                if (i == stage - 1) {
+                    redirect_stdin_from_pipe(downstream[i][0]);
+                } else {
+                    close(downstream[i][0]);
+                }
+                close(upstream[i][0]);
+                close(downstream[i][1]);
+            }
+            if (p == 0) {
+                int inputs[MAX_PIPESTAT_LINKS], outputs[MAX_PIPESTAT_LINKS];
+                for (int i = 0; i < num_links; i++) {
+                    inputs[i] = upstream[i][0];
+                    outputs[i] = downstream[i][1];
+                }
+                splice_relay(inputs, outputs, num_links, stat);
+            }
+            execute_child(&plan->stages[stage]);
+            _exit(EXIT_FAILURE);
+        }
+        enter_job_group(pids[p], plan->background);
+        if (plan->background) {
+            track_background_child(pids[p]);
+        }
+        if (p == 0 && stat != NULL) {
+            stat->relay = pids[0];
+        }
+    }
+    for (int i = 0; i < num_links; i++) {
+        close(upstream[i][0]);
+        close(upstream[i][1]);
+        close(downstream[i][0]);
+        close(downstream[i][1]);
+    }
+
+    if (plan->background) {
+        last_status = 0;
+        return 1;
+    }
+    return wait_for_job(pids, num_stages + 1);
+}
+
+// A statistics slot for a new relayed pipeline: a free one, else the one that finished longest ago
+struct pipeline_stat *claim_pipeline_stat(const struct plan *plan) {
+    if (pipeline_stats == NULL) {
+        void *region = mmap(NULL, sizeof(struct pipeline_stat) * MAX_PIPESTAT_PIPELINES, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            return NULL;
+        }
+        pipeline_stats = region;
+    }
+    struct pipeline_stat *slot = NULL;
+    for (int i = 0; i < MAX_PIPESTAT_PIPELINES; i++) {
+        struct pipeline_stat *candidate = &pipeline_stats[i];
+        if (candidate->relay == 0) {
+            slot = candidate;
+            break;
+        }
+        if (!candidate->running && (slot == NULL || candidate->finished_ns < slot->finished_ns)) {
+            slot = candidate;
+        }
+    }
+    if (slot == NULL) {
+        return NULL;
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->running = 1;
+    slot->num_links = plan->num_stages - 1;
+    slot->started_ns = monotonic_ns();
+    slot->relay = -1;
+    describe_plan(plan, slot->command, sizeof(slot->command));
+    return slot;
+}
+
+// Relay helper: one epoll loop splicing every link from its upstream pipe to its downstream pipe without
+// copying. A link that cannot move data waits on exactly one side, input or room, and the time is charged
+// to that side. Counters go straight into the shared slot; aligned 64-bit stores are not torn.
+void splice_relay(int *inputs, int *outputs, int count, struct pipeline_stat *stat) {
+    struct pipeline_stat unused;
+    if (stat == NULL) {
+        memset(&unused, 0, sizeof(unused));
+        stat = &unused;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        _exit(EXIT_FAILURE);
+    }
+    struct relay_link links[MAX_PIPESTAT_LINKS];
+    for (int i = 0; i < count; i++) {
+        links[i] = (struct relay_link){ inputs[i], outputs[i], 0, 0 };
+        fcntl(inputs[i], F_SETFL, O_NONBLOCK);
+        fcntl(outputs[i], F_SETFL, O_NONBLOCK);
+        // Registered with no events, relay_wait arms the one side a link is waiting on
+        struct epoll_event ev = { .events = 0, .data.u32 = 2 * i };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, inputs[i], &ev);
+        ev.data.u32 = 2 * i + 1;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, outputs[i], &ev);
+    }
+
+    int open_links = count;
+    while (open_links > 0) {
+        for (int i = 0; i < count; i++) {
+            struct relay_link *link = &links[i];
+            while (link->in != -1 && link->waiting == 0) {
+                ssize_t n = splice(link->in, NULL, link->out, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    stat->links[i].bytes += n;
+                    stat->links[i].splices++;
+                    continue;
+                }
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                int pending = 0;
+                if (n == -1 && errno == EAGAIN && ioctl(link->in, FIONREAD, &pending) == 0) {
+                    // Data waiting means the output is full, none means the upstream stage is behind
+                    relay_wait(epfd, link, i, pending > 0 ? 2 : 1, &stat->links[i]);
+                    continue;
+                }
+                // End of input, or the downstream stage has gone: the link is done
+                relay_wait(epfd, link, i, 0, &stat->links[i]);
+                close(link->in);
+                close(link->out);
+                link->in = link->out = -1;
+                open_links--;
+            }
+        }
+        if (open_links == 0) {
+            break;
+        }
+
+        struct epoll_event events[2 * MAX_PIPESTAT_LINKS];
+        int ready = epoll_wait(epfd, events, 2 * MAX_PIPESTAT_LINKS, -1);
+        for (int e = 0; e < ready; e++) {
+            int i = events[e].data.u32 / 2;
+            if (links[i].in != -1) {
+                relay_wait(epfd, &links[i], i, 0, &stat->links[i]);
+            }
+        }
+    }
+    stat->finished_ns = monotonic_ns();
+    stat->running = 0;
+    _exit(0);
+}
+
+// Move a link into a wait state (or out of one, waiting 0), arming its fd and charging the time spent
+void relay_wait(int epfd, struct relay_link *link, int index, int waiting, struct pipe_stat *stat) {
+    uint64_t now = monotonic_ns();
+    if (link->waiting == 1) {
+        stat->starved_ns += now - link->since_ns;
+    } else if (link->waiting == 2) {
+        stat->blocked_ns += now - link->since_ns;
+    }
+    if (link->waiting != 0) {
+        struct epoll_event ev = { .events = 0, .data.u32 = 2 * index + (link->waiting == 2) };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, link->waiting == 2 ? link->out : link->in, &ev);
+    }
+    if (waiting != 0) {
+        struct epoll_event ev = { .events = waiting == 2 ? EPOLLOUT : EPOLLIN, .data.u32 = 2 * index + (waiting == 2) };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, waiting == 2 ? link->out : link->in, &ev);
+    }
+    link->waiting = waiting;
+    link->since_ns = now;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// pipestat [-c] - bytes and wait times of every link of the relayed pipelines, live while they run;
+// -c forgets the finished ones
+int builtin_pipestat(int argc, char **argv, FILE *out) {
+    int clear = argc > 1 && strcmp(argv[1], "-c") == 0;
+    if (pipeline_stats == NULL) {
+        if (!clear) {
+            fprintf(out, "no relayed pipelines, enable them with set -o pipestat\n");
+        }
+        return 0;
+    }
+    uint64_t now = monotonic_ns();
+    for (int i = 0; i < MAX_PIPESTAT_PIPELINES; i++) {
+        struct pipeline_stat *stat = &pipeline_stats[i];
+        // A relay that was killed never marked itself finished
+        if (stat->running && stat->relay > 0 && kill(stat->relay, 0) == -1 && errno == ESRCH) {
+            stat->running = 0;
+            stat->finished_ns = now;
+        }
+        if (stat->relay == 0 || (clear && !stat->running)) {
+            if (clear) {
+                memset(stat, 0, sizeof(*stat));
+            }
+            continue;
+        }
+        if (clear) {
+            continue;
+        }
+        double seconds = ((stat->running ? now : stat->finished_ns) - stat->started_ns) / 1e9;
+        fprintf(out, "[%d] %-8s %8.3fs %s\n", i + 1, stat->running ? "running" : "done", seconds,
+                stat->command);
+        for (int l = 0; l < stat->num_links; l++) {
+            struct pipe_stat *link = &stat->links[l];
+            fprintf(out, "    %d -> %d  %14llu bytes  %10.1f MB/s  blocked %10.3f ms  starved %10.3f ms\n",
+                    l + 1, l + 2, (unsigned long long)link->bytes,
+                    seconds > 0 ? link->bytes / seconds / 1e6 : 0.0, link->blocked_ns / 1e6,
+                    link->starved_ns / 1e6);
+        }
+    }
+    return 0;
+}
+
+// Start the branches of a fan-out, each on its own pipe, and the relay copying input to all of them.
+// pids gets the relay first, so the last branch is the one whose status the pipeline reports.
+int start_fanout(struct plan *plan, int input, pid_t *pids) {
+    int num_branches = plan->num_stages - plan->fanout;
+    int *outputs = malloc(sizeof(int) * num_branches);
+    if (outputs == NULL) {
+        error_handling("Error - failed allocating the pipeline");
+        return 0;
+    }
+
+    for (int k = 0; k < num_branches; k++) {
+        int pipefd[2];
+        if (pipe(pipefd) == -1) {
+            error_handling("Error - failed piping");
+            return 0;
+        }
+        pids[1 + k] = fork_into_job(&plan->stages[plan->fanout + k]);
+        if (pids[1 + k] == -1) {
+            error_handling("Error - failed forking");
+            return 0;
+        }
+        if (pids[1 + k] == 0) {
+            is_child_process = 1;
+            enter_job_group(0, plan->background);
+            if (!plan->background) {
+                set_child_signal_handling();
+            }
+            // Only its own read end: a branch holding another branch's write end would never see EOF
+            close(input);
+            for (int j = 0; j < k; j++) {
+                close(outputs[j]);
+            }
+            close(pipefd[1]);
+            redirect_stdin_from_pipe(pipefd[0]);
+            execute_child(&plan->stages[plan->fanout + k]);
+            _exit(EXIT_FAILURE);
+        }
+        enter_job_group(pids[1 + k], plan->background);
+        if (plan->background) {
+            track_background_child(pids[1 + k]);
+        }
+        close(pipefd[0]);
+        outputs[k] = pipefd[1];
+    }
+
+    pids[0] = fork_into_job(NULL);
+    if (pids[0] == -1) {
+        error_handling("Error - failed forking");
+        return 0;
+    }
+    if (pids[0] == 0) {
+        is_child_process = 1;
+        enter_job_group(0, plan->background);
+        if (!plan->background) {
+            set_child_signal_handling();
+        }
+        fanout_relay(input, outputs, num_branches);
+    }
+    enter_job_group(pids[0], plan->background);
+    if (plan->background) {
+        track_background_child(pids[0]);
+    }
+    close(input);
+    for (int k = 0; k < num_branches; k++) {
+        close(outputs[k]);
+    }
+    free(outputs);
+    return 1;
+}
+
+// Relay helper: tee(2) duplicates each chunk of the input pipe into every branch but one without copying,
+// then splice(2) moves it into the last. A branch that could only take part of a chunk gets the rest by a
+// plain write, the only time the data passes through user space. Branches that exit are dropped.
+void fanout_relay(int input, int *outputs, int count) {
+    char *buf = malloc(RELAY_CHUNK);
+    size_t *sent = malloc(sizeof(size_t) * count);
+    if (buf == NULL || sent == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int first = -1, last = -1;
+        for (int k = 0; k < count; k++) {
+            if (outputs[k] != -1) {
+                first = first == -1 ? k : first;
+                last = k;
+            }
+        }
+        if (first == -1) {
+            break;
+        }
+        ssize_t n;
+        if (first == last) {
+            // One branch left, it simply gets the pipe's pages
+            n = splice(input, NULL, outputs[last], NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+            if (n == 0) {
+                break;
+            }
+            if (n == -1 && errno != EINTR) {
+                close(outputs[last]);
+                outputs[last] = -1;
+            }
+            continue;
+        }
+
+        // The first branch's tee sizes the chunk, the others must take exactly as much
+        n = tee(input, outputs[first], RELAY_CHUNK, 0);
+        if (n == 0) {
+            break;
+        }
+        if (n == -1) {
+            if (errno != EINTR) {
+                close(outputs[first]);
+                outputs[first] = -1;
+            }
+            continue;
+        }
+        int lagging = 0;
+        sent[first] = n;
+        for (int k = first + 1; k < last; k++) {
+            if (outputs[k] == -1) {
+                continue;
+            }
+            ssize_t m;
+            do {
+                m = tee(input, outputs[k], n, 0);
+            } while (m == -1 && errno == EINTR);
+            if (m == -1) {
+                close(outputs[k]);
+                outputs[k] = -1;
+                continue;
+            }
+            sent[k] = m;
+            lagging |= m < n;
+        }
+
+        ssize_t moved = 0;
+        while (!lagging && moved < n) {
+            ssize_t m = splice(input, NULL, outputs[last], NULL, n - moved, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                // The last branch is gone, what it did not take is still in the input
+                close(outputs[last]);
+                outputs[last] = -1;
+                break;
+            }
+            moved += m;
+        }
+        if (moved == n) {
+            continue;
+        }
+
+        // Consume the rest of the chunk through the buffer, completing every branch that fell short
+        ssize_t have = 0;
+        while (have < n - moved) {
+            ssize_t m = read(input, buf + have, n - moved - have);
+            if (m == -1 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                break;
+            }
+            have += m;
+        }
+        if (!lagging) {
+            continue;
+        }
+        for (int k = first; k <= last; k++) {
+            size_t from = k == last ? 0 : sent[k];
+            if (outputs[k] != -1 && from < (size_t)have && write_all(outputs[k], buf + from, have - from) == -1) {
+                close(outputs[k]);
+                outputs[k] = -1;
+            }
+        }
+    }
+    _exit(0);
+}
+
+// write(2) until everything is out, -1 once the reader has gone
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t m = write(fd, buf, len);
+        if (m == -1 && errno == EINTR) {
+            continue;
+        }
+        if (m <= 0) {
+            return -1;
+        }
+        buf += m;
+        len -= m;
+    }
+    return 0;
+}
+
+// Helper function to handle the file opening and redirection logic
+int open_and_redirect_file(const char *filename, int flags, int target_fd) {
+    int fd = open(filename, flags, 0777);
+    if (fd == -1) {
+        error_handling("Error - unable to open or create the specified file for redirection");
+    }
+    if (dup2(fd, target_fd) == -1) {
+        error_handling("Error - failed to redirect to the specified file");
+    }
+    close(fd);
+    return 1;
+}
+
+// Apply a stage's '<' and '>' redirections in the child, after any pipe ends are in place
+void apply_redirections(struct stage *stage) {
+    if (stage->input_file != NULL) {
+        open_and_redirect_file(stage->input_file, O_RDONLY, STDIN_FILENO);
+    }
+    if (stage->output_file != NULL) {
+        open_and_redirect_file(stage->output_file, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO);
+    }
+}
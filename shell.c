@@ -13,10 +13,21 @@ int process_arglist(int count, char** arglist);
 int prepare(void);
 int finalize(void);
 
-int main(void)
+// argc/argv - the shell's own command line, to compile or run a script instead of reading commands
+// RETURNS - -1 to read commands from stdin, otherwise the exit status of the shell
+int process_options(int argc, char** argv);
+
+int main(int argc, char** argv)
 {
 	if (prepare() != 0)
 		exit(1);
+
+	int status = process_options(argc, argv);
+	if (status != -1) {
+		if (finalize() != 0)
+			exit(1);
+		return status;
+	}
 	
 	while (1)
 	{